@@ -0,0 +1,77 @@
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include "numparse.hpp"
+
+// Micro-benchmark: OSM node attribute parsing with substr + stoll/stod
+// (what main.cpp used to do) versus numparse on const char* ranges.
+
+struct Sample {
+    std::string id, lat, lon;
+};
+
+template <typename F>
+double time_ms(F f) {
+    auto t0 = std::chrono::steady_clock::now();
+    f();
+    auto t1 = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::milli>(t1 - t0).count();
+}
+
+int main(int argc, char* argv[]) {
+    size_t count = argc > 1 ? std::stoul(argv[1]) : 2000000;
+
+    std::mt19937_64 rng(42);
+    std::uniform_int_distribution<long long> id_dist(1, 12000000000LL);
+    std::uniform_int_distribution<int> lat_dist(-900000000, 900000000);
+    std::uniform_int_distribution<int> lon_dist(-1800000000, 1800000000);
+
+    // Attribute text as it appears in a line: value followed by a quote
+    std::vector<Sample> samples(count);
+    char buf[32];
+    for (auto& s : samples) {
+        s.id = std::to_string(id_dist(rng)) + "\"";
+        int lat = lat_dist(rng), lon = lon_dist(rng);
+        std::snprintf(buf, sizeof(buf), "%s%d.%07d\"", lat < 0 ? "-" : "", std::abs(lat) / 10000000, std::abs(lat) % 10000000);
+        s.lat = buf;
+        std::snprintf(buf, sizeof(buf), "%s%d.%07d\"", lon < 0 ? "-" : "", std::abs(lon) / 10000000, std::abs(lon) % 10000000);
+        s.lon = buf;
+    }
+
+    std::vector<long long> ids_a(count), ids_b(count);
+    std::vector<double> lat_a(count), lat_b(count), lon_a(count), lon_b(count);
+
+    double old_ms = time_ms([&] {
+        for (size_t i = 0; i < count; ++i) {
+            const Sample& s = samples[i];
+            ids_a[i] = std::stoll(s.id.substr(0, s.id.find('"')));
+            lat_a[i] = std::stod(s.lat.substr(0, s.lat.find('"')));
+            lon_a[i] = std::stod(s.lon.substr(0, s.lon.find('"')));
+        }
+    });
+
+    double new_ms = time_ms([&] {
+        for (size_t i = 0; i < count; ++i) {
+            const Sample& s = samples[i];
+            int32_t lat, lon;
+            numparse::parse_id(s.id.data(), s.id.data() + s.id.size(), ids_b[i]);
+            numparse::parse_fixed7(s.lat.data(), s.lat.data() + s.lat.size(), lat);
+            numparse::parse_fixed7(s.lon.data(), s.lon.data() + s.lon.size(), lon);
+            lat_b[i] = numparse::fixed7_to_deg(lat);
+            lon_b[i] = numparse::fixed7_to_deg(lon);
+        }
+    });
+
+    size_t mismatches = 0;
+    for (size_t i = 0; i < count; ++i)
+        mismatches += ids_a[i] != ids_b[i] || lat_a[i] != lat_b[i] || lon_a[i] != lon_b[i];
+
+    std::cout << count << " nodes (id, lat, lon)\n";
+    std::cout << "substr + stoll/stod: " << old_ms << " ms, " << old_ms * 1e6 / count << " ns/node\n";
+    std::cout << "numparse:            " << new_ms << " ms, " << new_ms * 1e6 / count << " ns/node\n";
+    std::cout << "speedup: " << old_ms / new_ms << "x, mismatches: " << mismatches << "\n";
+    return mismatches ? 1 : 0;
+}
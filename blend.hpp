@@ -0,0 +1,130 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <string_view>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BLEND_X86 1
+#endif
+
+// Byte-wise alpha blending of a span: dst = (dst * (255 - a) + src * a) / 255,
+// rounded. Callers expand per-pixel coverage to one alpha byte per
+// channel, so the kernels never need to know the pixel layout. All
+// kernels round the same way and give identical results.
+//
+// The kernel is picked once at runtime from the CPU features;
+// OSM_BLEND=scalar|sse2|avx2 overrides it for comparisons.
+namespace blend {
+
+namespace detail {
+
+// x / 255 rounded to nearest, exact for x <= 255 * 255
+inline uint32_t div255(uint32_t x) {
+    x += 128;
+    return (x + (x >> 8)) >> 8;
+}
+
+inline void blend_scalar(uint8_t* dst, const uint8_t* src, const uint8_t* alpha, size_t n) {
+    for (size_t i = 0; i < n; ++i)
+        dst[i] = static_cast<uint8_t>(div255(dst[i] * (255u - alpha[i]) + src[i] * uint32_t(alpha[i])));
+}
+
+#ifdef BLEND_X86
+
+// Blend 8 bytes widened to 16-bit lanes
+inline __m128i blend_lanes_sse2(__m128i d, __m128i s, __m128i a) {
+    const __m128i full = _mm_set1_epi16(255), half = _mm_set1_epi16(128);
+    __m128i x = _mm_add_epi16(_mm_mullo_epi16(d, _mm_sub_epi16(full, a)), _mm_mullo_epi16(s, a));
+    x = _mm_add_epi16(x, half);
+    return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+}
+
+inline void blend_sse2(uint8_t* dst, const uint8_t* src, const uint8_t* alpha, size_t n) {
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(alpha + i));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(a, zero)) == 0xffff) continue;
+        __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(dst + i));
+        __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+        __m128i lo = blend_lanes_sse2(_mm_unpacklo_epi8(d, zero), _mm_unpacklo_epi8(s, zero),
+                                      _mm_unpacklo_epi8(a, zero));
+        __m128i hi = blend_lanes_sse2(_mm_unpackhi_epi8(d, zero), _mm_unpackhi_epi8(s, zero),
+                                      _mm_unpackhi_epi8(a, zero));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_packus_epi16(lo, hi));
+    }
+    blend_scalar(dst + i, src + i, alpha + i, n - i);
+}
+
+__attribute__((target("avx2")))
+inline __m256i blend_lanes_avx2(__m256i d, __m256i s, __m256i a) {
+    const __m256i full = _mm256_set1_epi16(255), half = _mm256_set1_epi16(128);
+    __m256i x = _mm256_add_epi16(_mm256_mullo_epi16(d, _mm256_sub_epi16(full, a)), _mm256_mullo_epi16(s, a));
+    x = _mm256_add_epi16(x, half);
+    return _mm256_srli_epi16(_mm256_add_epi16(x, _mm256_srli_epi16(x, 8)), 8);
+}
+
+// Unpack and pack both work within 128-bit lanes, so byte order survives
+__attribute__((target("avx2")))
+inline void blend_avx2(uint8_t* dst, const uint8_t* src, const uint8_t* alpha, size_t n) {
+    const __m256i zero = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(alpha + i));
+        if (_mm256_testz_si256(a, a)) continue;
+        __m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(dst + i));
+        __m256i s = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+        __m256i lo = blend_lanes_avx2(_mm256_unpacklo_epi8(d, zero), _mm256_unpacklo_epi8(s, zero),
+                                      _mm256_unpacklo_epi8(a, zero));
+        __m256i hi = blend_lanes_avx2(_mm256_unpackhi_epi8(d, zero), _mm256_unpackhi_epi8(s, zero),
+                                      _mm256_unpackhi_epi8(a, zero));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), _mm256_packus_epi16(lo, hi));
+    }
+    blend_sse2(dst + i, src + i, alpha + i, n - i);
+}
+
+#endif // BLEND_X86
+
+} // namespace detail
+
+struct Kernel {
+    const char* name;
+    void (*blend)(uint8_t* dst, const uint8_t* src, const uint8_t* alpha, size_t n);
+};
+
+inline Kernel select_kernel() {
+    const char* force = std::getenv("OSM_BLEND");
+    std::string_view want = force ? force : "";
+    Kernel scalar{"scalar", detail::blend_scalar};
+    if (want == "scalar") return scalar;
+#ifdef BLEND_X86
+    Kernel sse2{"sse2", detail::blend_sse2};
+    Kernel avx2{"avx2", detail::blend_avx2};
+    if (want == "sse2") return sse2;
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") ? avx2 : sse2;
+#else
+    return scalar;
+#endif
+}
+
+inline const Kernel& kernel() {
+    static const Kernel k = select_kernel();
+    return k;
+}
+
+// Blend n bytes of src into dst with per-byte alpha. Spans shorter than
+// a vector go straight to the scalar loop.
+inline void blend_span(uint8_t* dst, const uint8_t* src, const uint8_t* alpha, size_t n) {
+    if (n < 16) detail::blend_scalar(dst, src, alpha, n);
+    else kernel().blend(dst, src, alpha, n);
+}
+
+// Blend n bytes of src into dst with one alpha, for single pixels
+inline void blend_bytes(uint8_t* dst, const uint8_t* src, uint8_t alpha, size_t n) {
+    for (size_t i = 0; i < n; ++i)
+        dst[i] = static_cast<uint8_t>(detail::div255(dst[i] * (255u - alpha) + src[i] * uint32_t(alpha)));
+}
+
+} // namespace blend
@@ -1,148 +1,785 @@
-#ifndef BMP_HPP
-#define BMP_HPP
-
-#include <fstream>
-#include <vector>
-#include <stdexcept>
-#include <cstdint>
-#include <cstring>
-#include <string>
-#include <sstream>
-#include "color.h"
-#pragma pack(push, 1)
-struct BMPHeader {
-    uint16_t file_type{0x4D42}; // 'BM' in little endian
-    uint32_t file_size{0};      // File size in bytes
-    uint16_t reserved1{0};      // Reserved field
-    uint16_t reserved2{0};      // Reserved field
-    uint32_t data_offset{54};   // Offset where image data begins
-
-    uint32_t header_size{40};   // Size of the DIB header (40 bytes)
-    int32_t width{0};           // Image width
-    int32_t height{0};          // Image height
-    uint16_t color_planes{1};   // Number of color planes
-    uint16_t bits_per_pixel{24}; // Bits per pixel (24 for RGB)
-    uint32_t compression{0};    // Compression method (0 = none)
-    uint32_t image_size{0};     // Image size (can be 0 for uncompressed)
-    int32_t x_pixels_per_meter{2835};
-    int32_t y_pixels_per_meter{2835};
-    uint32_t colors_used{0};
-    uint32_t colors_important{0};
-};
-#pragma pack(pop)
-class BMP {
-public:
-    BMP(int width, int height) : width(width), height(height) {
-        row_size = width * 3;  // 3 bytes per pixel
-        padded_row_size = (row_size + 3) & ~3; // Align to 4-byte boundary
-        data.resize(padded_row_size * height, 255); // Initialize with white
-    }
-
-    BMP(const std::string& file_name) {
-        read(file_name);
-    }
-
-    void set_pixel(int x, int y, uint8_t r, uint8_t g, uint8_t b) {
-        if (x >= 0 && x < width && y >= 0 && y < height) {
-            int index = ((height - 1 - y) * padded_row_size) + (x * 3);
-            data[index] = b;
-            data[index + 1] = g;
-            data[index + 2] = r;
-        }
-    }
-
-    void get_pixel(int x, int y, uint8_t& r, uint8_t& g, uint8_t& b) const {
-        if (x >= 0 && x < width && y >= 0 && y < height) {
-            int index = ((height - 1 - y) * padded_row_size) + (x * 3);
-            b = data[index];
-            g = data[index + 1];
-            r = data[index + 2];
-        }
-    }
-
-    void write(const std::string& file_name) const {
-        std::ofstream out(file_name, std::ios::binary);
-        if (!out) {
-            throw std::runtime_error("Failed to open file for writing.");
-        }
-
-        BMPHeader bmp_header;
-       
-
-        bmp_header.file_size = sizeof(BMPHeader)  + data.size();
-        
-
-        bmp_header.width = width;
-        bmp_header.height = height;
-        bmp_header.image_size = data.size();
-
-        out.write(reinterpret_cast<const char*>(&bmp_header), sizeof(bmp_header));
-       
-        out.write(reinterpret_cast<const char*>(data.data()), data.size());
-    }
-
-    void read(const std::string& file_name) {
-        std::ifstream in(file_name, std::ios::binary);
-        if (!in) {
-            throw std::runtime_error("Failed to open file for reading.");
-        }
-
-        BMPHeader bmp_header;
-        
-
-        in.read(reinterpret_cast<char*>(&bmp_header), sizeof(bmp_header));
-        //in.read(reinterpret_cast<char*>(&dib_header), sizeof(dib_header));
-
-        if (bmp_header.file_type != 0x4D42) {
-            throw std::runtime_error("Not a valid BMP file.");
-        }
-
-        if (bmp_header.bits_per_pixel != 24) {
-            throw std::runtime_error("Only 24-bit BMP files are supported.");
-        }
-
-        width = bmp_header.width;
-        height = bmp_header.height;
-
-        row_size = width * 3;
-        padded_row_size = (row_size + 3) & ~3;
-
-        data.resize(padded_row_size * height);
-
-        in.seekg(bmp_header.data_offset, std::ios::beg);
-        in.read(reinterpret_cast<char*>(data.data()), data.size());
-    }
-
-    int get_width() const {
-        return width;
-    }
-
-    int get_height() const {
-        return height;
-    }
-
-private:
-    int width{0};
-    int height{0};
-    int row_size{0};
-    int padded_row_size{0};
-    std::vector<uint8_t> data;
-};
-
-
-void draw_line(BMP& bmp, int x0, int y0, int x1, int y1, const color& c) {
-    int dx = abs(x1 - x0), dy = -abs(y1 - y0);
-    int sx = x0 < x1 ? 1 : -1;
-    int sy = y0 < y1 ? 1 : -1;
-    int err = dx + dy;
-    while (true) {
-        bmp.set_pixel(x0, y0, c.r, c.g, c.b);
-        if (x0 == x1 && y0 == y1) break;
-        int e2 = 2 * err;
-        if (e2 >= dy) { err += dy; x0 += sx; }
-        if (e2 <= dx) { err += dx; y0 += sy; }
-    }
-}
-
-
+#ifndef BMP_HPP
+#define BMP_HPP
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <fstream>
+#include <vector>
+#include <stdexcept>
+#include <cstdint>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <sstream>
+#include <utility>
+#include "color.h"
+#include "blend.hpp"
+#pragma pack(push, 1)
+struct BMPHeader {
+    uint16_t file_type{0x4D42}; // 'BM' in little endian
+    uint32_t file_size{0};      // File size in bytes
+    uint16_t reserved1{0};      // Reserved field
+    uint16_t reserved2{0};      // Reserved field
+    uint32_t data_offset{54};   // Offset where image data begins
+
+    uint32_t header_size{40};   // Size of the DIB header (40 bytes)
+    int32_t width{0};           // Image width
+    int32_t height{0};          // Image height
+    uint16_t color_planes{1};   // Number of color planes
+    uint16_t bits_per_pixel{24}; // Bits per pixel (24 for RGB)
+    uint32_t compression{0};    // Compression method (0 = none)
+    uint32_t image_size{0};     // Image size (can be 0 for uncompressed)
+    int32_t x_pixels_per_meter{2835};
+    int32_t y_pixels_per_meter{2835};
+    uint32_t colors_used{0};
+    uint32_t colors_important{0};
+};
+#pragma pack(pop)
+// Canvas in one of the BMP pixel formats: 24-bit BGR, or 8-bit / 1-bit
+// indices into a fixed palette. Indexed canvases start filled with
+// palette[0], and colors not in the palette draw as the nearest entry.
+class BMP {
+public:
+    BMP(int width, int height) : width(width), height(height) {
+        check_size(width, height, bits, 0);
+        row_size = width * 3;  // 3 bytes per pixel
+        padded_row_size = (row_size + 3) & ~3; // Align to 4-byte boundary
+        data.resize(pixel_bytes(), 255); // Initialize with white
+        pixels = data.data();
+    }
+
+    BMP(int width, int height, int bits_per_pixel, const std::vector<color>& palette)
+        : width(width), height(height), bits(bits_per_pixel), colors(palette) {
+        if (bits == 24) {
+            colors.clear();
+        } else if (bits != 8 && bits != 1) {
+            throw std::runtime_error("Only 24, 8 and 1-bit BMP files are supported.");
+        } else if (colors.empty() || colors.size() > (1u << bits)) {
+            throw std::runtime_error("Palette does not fit the pixel format.");
+        }
+        check_size(width, height, bits, colors.size());
+        row_size = (width * bits + 7) / 8;
+        padded_row_size = (row_size + 3) & ~3;
+        data.resize(pixel_bytes(), bits == 24 ? 255 : 0);
+        pixels = data.data();
+    }
+
+    BMP(const std::string& file_name) {
+        read(file_name);
+    }
+
+    // Canvas whose pixels live in file_name, created at its final size and
+    // mapped, so drawing writes straight into the page cache and there is
+    // no copy on output. The file is complete once the BMP is destroyed;
+    // flush() forces it to disk earlier. An indexed canvas starts as the
+    // zero pages of a sparse file, a 24-bit one has to be filled white.
+    static BMP map_file(const std::string& file_name, int width, int height, int bits_per_pixel = 24,
+                        const std::vector<color>& palette = {}) {
+        BMP bmp(0, 0, bits_per_pixel, palette); // checks the pixel format
+        check_size(width, height, bmp.bits, bmp.colors.size());
+        bmp.width = width;
+        bmp.height = height;
+        bmp.row_size = (width * bmp.bits + 7) / 8;
+        bmp.padded_row_size = (bmp.row_size + 3) & ~3;
+        BMPHeader bmp_header = make_header(width, height, bmp.bits, bmp.colors.size());
+
+        int fd = ::open(file_name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            throw std::runtime_error("Failed to open file for writing.");
+        }
+        if (ftruncate(fd, bmp_header.file_size) != 0) {
+            ::close(fd);
+            throw std::runtime_error("Failed to size BMP file.");
+        }
+        void* m = mmap(nullptr, bmp_header.file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (m == MAP_FAILED) {
+            throw std::runtime_error("Failed to map BMP file.");
+        }
+        bmp.map_base = static_cast<uint8_t*>(m);
+        bmp.map_size = bmp_header.file_size;
+
+        std::memcpy(bmp.map_base, &bmp_header, sizeof(bmp_header));
+        uint8_t* quad = bmp.map_base + sizeof(bmp_header);
+        for (const color& c : bmp.colors) {
+            *quad++ = uint8_t(c.b);
+            *quad++ = uint8_t(c.g);
+            *quad++ = uint8_t(c.r);
+            *quad++ = 0;
+        }
+        bmp.pixels = bmp.map_base + bmp_header.data_offset;
+        if (bmp.bits == 24) {
+            std::memset(bmp.pixels, 255, bmp.pixel_bytes());
+        }
+        return bmp;
+    }
+
+    BMP(const BMP& other) {
+        copy_from(other);
+    }
+
+    BMP(BMP&& other) noexcept {
+        take(std::move(other));
+    }
+
+    BMP& operator=(const BMP& other) {
+        if (this != &other) {
+            unmap();
+            copy_from(other);
+        }
+        return *this;
+    }
+
+    BMP& operator=(BMP&& other) noexcept {
+        if (this != &other) {
+            unmap();
+            take(std::move(other));
+        }
+        return *this;
+    }
+
+    ~BMP() {
+        unmap();
+    }
+
+    // Write back a mapped canvas now; a no-op for in-memory ones
+    void flush() {
+        if (map_base && msync(map_base, map_size, MS_SYNC) != 0) {
+            throw std::runtime_error("Failed to write mapped BMP file.");
+        }
+    }
+
+    void set_pixel(int x, int y, uint8_t r, uint8_t g, uint8_t b) {
+        if (x >= 0 && x < width && y >= 0 && y < height) {
+            put_pixel(x, y, ink(color(r, g, b)));
+        }
+    }
+
+    // No bounds check: for callers that clip first
+    void set_pixel_unchecked(int x, int y, uint8_t r, uint8_t g, uint8_t b) {
+        put_pixel(x, y, ink(color(r, g, b)));
+    }
+
+    // Pixel value of c on this canvas: packed BGR, or its palette index.
+    // Resolve once per line and draw with put_pixel.
+    uint32_t ink(const color& c) const {
+        if (bits == 24) {
+            return uint32_t(c.b & 0xff) | uint32_t(c.g & 0xff) << 8 | uint32_t(c.r & 0xff) << 16;
+        }
+        uint32_t best = 0;
+        long best_dist = -1;
+        for (uint32_t i = 0; i < colors.size(); ++i) {
+            long dr = c.r - colors[i].r, dg = c.g - colors[i].g, db = c.b - colors[i].b;
+            long dist = dr * dr + dg * dg + db * db;
+            if (best_dist < 0 || dist < best_dist) {
+                best = i;
+                best_dist = dist;
+            }
+        }
+        return best;
+    }
+
+    // Store a value from ink(); no bounds check
+    void put_pixel(int x, int y, uint32_t value) {
+        size_t offset = static_cast<size_t>(height - 1 - y) * padded_row_size;
+        if (bits == 24) {
+            uint8_t* p = &pixels[offset + x * 3];
+            p[0] = static_cast<uint8_t>(value);
+            p[1] = static_cast<uint8_t>(value >> 8);
+            p[2] = static_cast<uint8_t>(value >> 16);
+        } else if (bits == 8) {
+            pixels[offset + x] = static_cast<uint8_t>(value);
+        } else {
+            uint8_t mask = 0x80 >> (x & 7);
+            uint8_t& byte = pixels[offset + (x >> 3)];
+            byte = value ? byte | mask : byte & ~mask;
+        }
+    }
+
+    void get_pixel(int x, int y, uint8_t& r, uint8_t& g, uint8_t& b) const {
+        if (x >= 0 && x < width && y >= 0 && y < height) {
+            const uint8_t* p = row(y);
+            if (bits == 24) {
+                b = p[x * 3];
+                g = p[x * 3 + 1];
+                r = p[x * 3 + 2];
+                return;
+            }
+            uint32_t i = bits == 8 ? p[x] : (p[x >> 3] >> (7 - (x & 7))) & 1;
+            const color& c = colors[i < colors.size() ? i : 0];
+            r = c.r;
+            g = c.g;
+            b = c.b;
+        }
+    }
+
+    // Raw bytes of row y (0 = top) in the canvas pixel format
+    const uint8_t* row(int y) const {
+        return pixels + static_cast<size_t>(height - 1 - y) * padded_row_size;
+    }
+
+    uint8_t* row(int y) {
+        return pixels + static_cast<size_t>(height - 1 - y) * padded_row_size;
+    }
+
+    void write(const std::string& file_name) const {
+        std::ofstream out(file_name, std::ios::binary);
+        if (!out) {
+            throw std::runtime_error("Failed to open file for writing.");
+        }
+
+        BMPHeader bmp_header = make_header(width, height, bits, colors.size());
+        out.write(reinterpret_cast<const char*>(&bmp_header), sizeof(bmp_header));
+        write_palette(out, colors);
+        out.write(reinterpret_cast<const char*>(pixels), pixel_bytes());
+    }
+
+    void read(const std::string& file_name) {
+        std::ifstream in(file_name, std::ios::binary);
+        if (!in) {
+            throw std::runtime_error("Failed to open file for reading.");
+        }
+
+        BMPHeader bmp_header;
+        
+
+        in.read(reinterpret_cast<char*>(&bmp_header), sizeof(bmp_header));
+        //in.read(reinterpret_cast<char*>(&dib_header), sizeof(dib_header));
+
+        if (bmp_header.file_type != 0x4D42) {
+            throw std::runtime_error("Not a valid BMP file.");
+        }
+
+        bits = bmp_header.bits_per_pixel;
+        if (bits != 24 && bits != 8 && bits != 1) {
+            throw std::runtime_error("Only 24, 8 and 1-bit BMP files are supported.");
+        }
+        if (bmp_header.compression != 0) {
+            throw std::runtime_error("Compressed BMP files are not supported.");
+        }
+
+        check_size(bmp_header.width, bmp_header.height, bits, 0);
+        width = bmp_header.width;
+        height = bmp_header.height;
+
+        // The palette follows the DIB header as B, G, R, reserved quads
+        colors.clear();
+        if (bits != 24) {
+            uint32_t count = bmp_header.colors_used ? bmp_header.colors_used : 1u << bits;
+            if (count > (1u << bits)) {
+                throw std::runtime_error("BMP palette is too large.");
+            }
+            std::vector<uint8_t> quads(count * 4);
+            in.seekg(14 + bmp_header.header_size, std::ios::beg);
+            in.read(reinterpret_cast<char*>(quads.data()), quads.size());
+            for (uint32_t i = 0; i < count; ++i) {
+                colors.emplace_back(quads[i * 4 + 2], quads[i * 4 + 1], quads[i * 4]);
+            }
+        }
+
+        row_size = (width * bits + 7) / 8;
+        padded_row_size = (row_size + 3) & ~3;
+
+        unmap();
+        data.resize(pixel_bytes());
+        pixels = data.data();
+
+        in.seekg(bmp_header.data_offset, std::ios::beg);
+        in.read(reinterpret_cast<char*>(pixels), pixel_bytes());
+        if (!in) {
+            throw std::runtime_error("BMP file is truncated.");
+        }
+    }
+
+    int get_width() const {
+        return width;
+    }
+
+    int get_height() const {
+        return height;
+    }
+
+    int bits_per_pixel() const {
+        return bits;
+    }
+
+    // Empty for 24-bit canvases
+    const std::vector<color>& palette() const {
+        return colors;
+    }
+
+private:
+    friend class BMPStreamWriter;
+    int width{0};
+    int height{0};
+    int bits{24};
+    int row_size{0};
+    int padded_row_size{0};
+    std::vector<color> colors;
+    std::vector<uint8_t> data;
+    uint8_t* pixels{nullptr};  // data.data(), or into the file mapping
+    uint8_t* map_base{nullptr};
+    size_t map_size{0};
+
+    size_t pixel_bytes() const {
+        return static_cast<size_t>(padded_row_size) * height;
+    }
+
+    void copy_from(const BMP& other) {
+        width = other.width;
+        height = other.height;
+        bits = other.bits;
+        row_size = other.row_size;
+        padded_row_size = other.padded_row_size;
+        colors = other.colors;
+        // A copy of a mapped canvas is an ordinary in-memory one
+        data.assign(other.pixels, other.pixels + other.pixel_bytes());
+        pixels = data.data();
+    }
+
+    void take(BMP&& other) {
+        width = other.width;
+        height = other.height;
+        bits = other.bits;
+        row_size = other.row_size;
+        padded_row_size = other.padded_row_size;
+        colors = std::move(other.colors);
+        data = std::move(other.data);
+        pixels = other.map_base ? other.pixels : data.data();
+        map_base = other.map_base;
+        map_size = other.map_size;
+        other.pixels = nullptr;
+        other.map_base = nullptr;
+        other.map_size = 0;
+    }
+
+    void unmap() {
+        if (map_base) {
+            munmap(map_base, map_size);
+            map_base = nullptr;
+            map_size = 0;
+            pixels = data.data();
+        }
+    }
+
+    // Size in bytes of the whole file. Throws for negative sizes and for
+    // images whose file size does not fit the 32-bit field of the header.
+    static uint64_t check_size(int width, int height, int bits, size_t palette_size) {
+        if (width < 0 || height < 0) {
+            throw std::runtime_error("BMP width and height must not be negative.");
+        }
+        uint64_t padded_row = ((uint64_t(width) * bits + 7) / 8 + 3) & ~uint64_t(3);
+        uint64_t file_size = sizeof(BMPHeader) + palette_size * 4 + padded_row * uint64_t(height);
+        if (file_size > UINT32_MAX) {
+            throw std::runtime_error("Image of " + std::to_string(width) + "x" + std::to_string(height) +
+                                     " is over the 4 GiB BMP limit.");
+        }
+        return file_size;
+    }
+
+    static BMPHeader make_header(int width, int height, int bits, size_t palette_size) {
+        BMPHeader bmp_header;
+        uint64_t file_size = check_size(width, height, bits, palette_size);
+        bmp_header.width = width;
+        bmp_header.height = height;
+        bmp_header.bits_per_pixel = bits;
+        bmp_header.colors_used = palette_size;
+        bmp_header.data_offset = sizeof(BMPHeader) + palette_size * 4;
+        bmp_header.file_size = static_cast<uint32_t>(file_size);
+        bmp_header.image_size = bmp_header.file_size - bmp_header.data_offset;
+        return bmp_header;
+    }
+
+    static void write_palette(std::ostream& out, const std::vector<color>& colors) {
+        for (const color& c : colors) {
+            uint8_t quad[4] = {uint8_t(c.b), uint8_t(c.g), uint8_t(c.r), 0};
+            out.write(reinterpret_cast<const char*>(quad), 4);
+        }
+    }
+};
+
+// Writes a BMP file one horizontal band at a time, so the full canvas
+// never has to be in memory. BMP stores rows bottom up, so bands must be
+// appended starting from the bottom of the image. Bands must share the
+// pixel format and palette given here.
+class BMPStreamWriter {
+public:
+    BMPStreamWriter(const std::string& file_name, int width, int height, int bits_per_pixel = 24,
+                    const std::vector<color>& palette = {})
+        : out(file_name, std::ios::binary), width(width), height(height), bits(bits_per_pixel) {
+        if (!out) {
+            throw std::runtime_error("Failed to open file for writing.");
+        }
+        std::vector<color> colors = bits == 24 ? std::vector<color>() : palette;
+        BMPHeader bmp_header = BMP::make_header(width, height, bits, colors.size());
+        out.write(reinterpret_cast<const char*>(&bmp_header), sizeof(bmp_header));
+        BMP::write_palette(out, colors);
+    }
+
+    // Append band, whose rows lie directly above those written so far
+    void write_band(const BMP& band) {
+        if (band.width != width || band.bits != bits || rows + band.height > height) {
+            throw std::runtime_error("Band does not fit the image.");
+        }
+        out.write(reinterpret_cast<const char*>(band.pixels), band.pixel_bytes());
+        rows += band.height;
+    }
+
+    int rows_written() const {
+        return rows;
+    }
+
+    void finish() {
+        if (rows != height) {
+            throw std::runtime_error("Image closed before all rows were written.");
+        }
+        out.close();
+        if (!out) {
+            throw std::runtime_error("Failed to write BMP file.");
+        }
+    }
+
+private:
+    std::ofstream out;
+    int width;
+    int height;
+    int bits;
+    int rows{0};
+};
+
+
+// Half-open pixel rectangle [x0, x1) x [y0, y1)
+struct Rect {
+    int x0, y0, x1, y1;
+};
+
+// Floor division for a possibly negative numerator
+inline long long floor_div(long long a, long long b) {
+    return a / b - ((a % b != 0) && ((a < 0) != (b < 0)));
+}
+
+// Bresenham's line clipped to clip before stepping. Along the major axis
+// step i (0..n) the minor offset is floor((2*i*m + n) / (2*n)), which is
+// exactly what the classic error-term loop produces. That closed form
+// lets us solve for the range of i inside clip (Liang-Barsky in integer
+// line-parameter space), start the error term there and write only
+// visible pixels, without a per-pixel bounds check. clip must lie
+// inside the canvas.
+void draw_line(BMP& bmp, int x0, int y0, int x1, int y1, const color& c, const Rect& clip) {
+    long long dx = static_cast<long long>(x1) - x0, dy = static_cast<long long>(y1) - y0;
+    bool x_major = std::llabs(dx) >= std::llabs(dy);
+    // a: major axis, b: minor axis
+    long long a0 = x_major ? x0 : y0, b0 = x_major ? y0 : x0;
+    int sa = (x_major ? dx : dy) < 0 ? -1 : 1;
+    int sb = (x_major ? dy : dx) < 0 ? -1 : 1;
+    long long n = x_major ? std::llabs(dx) : std::llabs(dy);
+    long long m = x_major ? std::llabs(dy) : std::llabs(dx);
+    long long a_min = x_major ? clip.x0 : clip.y0, a_max = (x_major ? clip.x1 : clip.y1) - 1;
+    long long b_min = x_major ? clip.y0 : clip.x0, b_max = (x_major ? clip.y1 : clip.x1) - 1;
+
+    // Range of i allowed by the major axis
+    long long lo = 0, hi = n;
+    if (sa > 0) { lo = std::max(lo, a_min - a0); hi = std::min(hi, a_max - a0); }
+    else        { lo = std::max(lo, a0 - a_max); hi = std::min(hi, a0 - a_min); }
+
+    // Range of the minor offset f(i), then of i
+    long long f_lo = sb > 0 ? b_min - b0 : b0 - b_max;
+    long long f_hi = sb > 0 ? b_max - b0 : b0 - b_min;
+    if (m == 0) {
+        if (f_lo > 0 || f_hi < 0) return;
+    } else {
+        // f(i) >= f_lo  <=>  i >= ceil((2*n*f_lo - n) / (2*m))
+        lo = std::max(lo, -floor_div(n - 2 * n * f_lo, 2 * m));
+        // f(i) <= f_hi  <=>  i <= ceil((2*n*(f_hi+1) - n) / (2*m)) - 1
+        hi = std::min(hi, -floor_div(n - 2 * n * (f_hi + 1), 2 * m) - 1);
+    }
+    if (lo > hi) return;
+
+    long long two_n = 2 * std::max(n, 1LL), num = 2 * lo * m + n;
+    long long f = num / two_n, rem = num % two_n;
+    long long a = a0 + sa * lo, b = b0 + sb * f;
+    uint32_t ink = bmp.ink(c);
+    for (long long i = lo; i <= hi; ++i) {
+        if (x_major) bmp.put_pixel(static_cast<int>(a), static_cast<int>(b), ink);
+        else         bmp.put_pixel(static_cast<int>(b), static_cast<int>(a), ink);
+        a += sa;
+        rem += 2 * m;
+        if (rem >= two_n) { rem -= two_n; b += sb; }
+    }
+}
+
+void draw_line(BMP& bmp, int x0, int y0, int x1, int y1, const color& c) {
+    draw_line(bmp, x0, y0, x1, y1, c, Rect{0, 0, bmp.get_width(), bmp.get_height()});
+}
+
+// std::floor without the libm call it compiles to on baseline x86-64
+inline long long floor_ll(double v) {
+    long long i = static_cast<long long>(v);
+    return i - (v < static_cast<double>(i));
+}
+
+// Xiaolin Wu's line for strokes up to a pixel wide: one step along the
+// major axis at a time, with the coverage split between the two pixels
+// the line passes between. alpha (0..255) scales the coverage. Each
+// position is computed from the end point, not accumulated, so clipping
+// to a band gives the same pixels as drawing the whole line.
+void draw_wu_line(BMP& bmp, double x0, double y0, double x1, double y1, double alpha, const color& c,
+                  const Rect& clip) {
+    // Pixel space to pixel index space, where pixel i is centered on i
+    x0 -= 0.5, y0 -= 0.5, x1 -= 0.5, y1 -= 0.5;
+    bool steep = std::abs(y1 - y0) > std::abs(x1 - x0);
+    if (steep) {
+        std::swap(x0, y0);
+        std::swap(x1, y1);
+    }
+    if (x0 > x1) {
+        std::swap(x0, x1);
+        std::swap(y0, y1);
+    }
+    double grad = x1 > x0 ? (y1 - y0) / (x1 - x0) : 0;
+    // a: major axis, b: minor axis
+    long long a_min = steep ? clip.y0 : clip.x0, a_max = (steep ? clip.y1 : clip.x1) - 1;
+    long long b_min = steep ? clip.x0 : clip.y0, b_max = (steep ? clip.x1 : clip.y1) - 1;
+    long long first = std::max(a_min, floor_ll(x0 + 0.5));
+    long long last = std::min(a_max, floor_ll(x1 + 0.5));
+
+    const bool rgb = bmp.bits_per_pixel() == 24;
+    const uint32_t ink = bmp.ink(c);
+    const uint8_t bgr[3] = {uint8_t(ink), uint8_t(ink >> 8), uint8_t(ink >> 16)};
+    auto plot = [&](long long a, long long b, double cov) {
+        if (b < b_min || b > b_max) return;
+        uint8_t a8 = static_cast<uint8_t>(cov * alpha + 0.5);
+        int px = static_cast<int>(steep ? b : a), py = static_cast<int>(steep ? a : b);
+        if (rgb) blend::blend_bytes(bmp.row(py) + 3 * px, bgr, a8, 3);
+        else if (a8 >= 128) bmp.put_pixel(px, py, ink);
+    };
+    // Keep the integer part of y0 out of the sums, so a line moved by
+    // whole pixels rounds the same way
+    long long base = floor_ll(y0);
+    double frac = y0 - base;
+    for (long long a = first; a <= last; ++a) {
+        double b = frac + grad * (a - x0);
+        long long fb = floor_ll(b);
+        plot(a, base + fb, 1 - (b - fb));
+        plot(a, base + fb + 1, b - fb);
+    }
+}
+
+// Anti-aliased line of the given width with round caps, between points
+// in pixel space where pixel (x, y) has its center at (x + 0.5, y + 0.5).
+// Each row of the line is found analytically as the slice of the capsule
+// it crosses; the coverage of every pixel in it comes from the distance
+// of its center to the segment, and the row is blended in one call to
+// blend::blend_span. Lines up to a pixel wide take the much cheaper
+// draw_wu_line, faded when thinner. Indexed canvases cannot blend: they
+// get the pixels that are at least half covered. clip must lie inside
+// the canvas.
+void draw_wide_line(BMP& bmp, double x0, double y0, double x1, double y1, double width, const color& c,
+                    const Rect& clip) {
+    if (width <= 1) {
+        draw_wu_line(bmp, x0, y0, x1, y1, std::max(width, 0.0) * 255.0, c, clip);
+        return;
+    }
+    const double r = width / 2 + 0.5; // no coverage this far from the center line
+    const double dx = x1 - x0, dy = y1 - y0, len2 = dx * dx + dy * dy, len = std::sqrt(len2);
+    const double inv_len = len > 0 ? 1 / len : 0, inv_dx = dx != 0 ? 1 / dx : 0, inv_dy = dy != 0 ? 1 / dy : 0;
+
+    int ya = std::max(clip.y0, static_cast<int>(std::floor(std::min(y0, y1) - r)));
+    int yb = std::min(clip.y1 - 1, static_cast<int>(std::ceil(std::max(y0, y1) + r)));
+    if (ya > yb) return;
+
+    const bool rgb = bmp.bits_per_pixel() == 24;
+    const uint32_t ink = bmp.ink(c);
+    thread_local std::vector<uint8_t> src, alpha;
+
+    for (int y = ya; y <= yb; ++y) {
+        const double cy = y + 0.5, ry = cy - y0;
+        double lo = HUGE_VAL, hi = -HUGE_VAL;
+        auto cover = [&](double a, double b) {
+            lo = std::min(lo, a);
+            hi = std::max(hi, b);
+        };
+        // The round caps
+        for (int end = 0; end < 2; ++end) {
+            double px = end ? x1 : x0, py = end ? y1 : y0, h = r * r - (cy - py) * (cy - py);
+            if (h >= 0) cover(px - std::sqrt(h), px + std::sqrt(h));
+        }
+        // The body: 0 <= (q - p0).d <= len2 and |(q - p0) x d| <= r * len,
+        // both linear in x, with the divisions hoisted out of the loop
+        if (len2 > 0) {
+            double a = -HUGE_VAL, b = HUGE_VAL;
+            if (dx != 0) {
+                double t0 = -ry * dy * inv_dx, t1 = t0 + len2 * inv_dx;
+                a = std::min(t0, t1);
+                b = std::max(t0, t1);
+            } else if (ry * dy < 0 || ry * dy > len2) {
+                a = HUGE_VAL;
+            }
+            if (dy != 0) {
+                double mid = ry * dx * inv_dy, half = std::abs(r * len * inv_dy);
+                a = std::max(a, mid - half);
+                b = std::min(b, mid + half);
+            } else if (std::abs(ry * dx) > r * len) {
+                a = HUGE_VAL;
+            }
+            if (a <= b) cover(x0 + a, x0 + b);
+        }
+        if (!(lo <= hi)) continue;
+        lo = std::max(lo, clip.x0 - 1.0);
+        hi = std::min(hi, clip.x1 + 1.0);
+        int xa = static_cast<int>(std::max<long long>(clip.x0, -floor_ll(0.5 - lo)));
+        int xb = static_cast<int>(std::min<long long>(clip.x1 - 1, floor_ll(hi - 0.5)));
+        if (xa > xb) continue;
+
+        size_t n = xb - xa + 1;
+        if (rgb && alpha.size() < 3 * n) {
+            alpha.resize(3 * n);
+            src.resize(3 * n);
+        }
+        if (rgb) {
+            for (size_t i = 0; i < n; ++i) {
+                src[3 * i] = static_cast<uint8_t>(ink);
+                src[3 * i + 1] = static_cast<uint8_t>(ink >> 8);
+                src[3 * i + 2] = static_cast<uint8_t>(ink >> 16);
+            }
+        }
+        for (size_t i = 0; i < n; ++i) {
+            // Distance to the center line where the pixel projects onto the
+            // segment, to the nearer end point past it
+            double qx = xa + i + 0.5 - x0, proj = qx * dx + ry * dy, d;
+            if (len2 > 0 && proj >= 0 && proj <= len2) {
+                d = std::abs(qx * dy - ry * dx) * inv_len;
+            } else {
+                double ex = proj > 0 ? qx - dx : qx, ey = proj > 0 ? ry - dy : ry;
+                d = std::sqrt(ex * ex + ey * ey);
+            }
+            double cov = std::clamp(r - d, 0.0, 1.0);
+            uint8_t a8 = static_cast<uint8_t>(cov * 255.0 + 0.5);
+            if (rgb) alpha[3 * i] = alpha[3 * i + 1] = alpha[3 * i + 2] = a8;
+            else if (a8 >= 128) bmp.put_pixel(xa + static_cast<int>(i), y, ink);
+        }
+        if (rgb) blend::blend_span(bmp.row(y) + 3 * xa, src.data(), alpha.data(), 3 * n);
+    }
+}
+
+void draw_wide_line(BMP& bmp, double x0, double y0, double x1, double y1, double width, const color& c) {
+    draw_wide_line(bmp, x0, y0, x1, y1, width, c, Rect{0, 0, bmp.get_width(), bmp.get_height()});
+}
+
+// Inside test for fill_polygon, as SVG's fill-rule: even-odd counts edge
+// crossings, non-zero sums their directions
+enum class FillRule { EvenOdd, NonZero };
+
+// Polygon vertex in pixel space, where pixel (x, y) is the unit square
+// with its center at (x + 0.5, y + 0.5)
+struct PolyPoint {
+    double x, y;
+};
+
+// Scanline fill of a polygon of one or more rings, ring i being
+// pts[ring_start[i], ring_start[i + 1]) and implicitly closed. A pixel is
+// filled when its center is inside under rule, so rings sharing an edge
+// never both fill a pixel. The edges go into a table sorted by their
+// first row; going down, the active edges give the row's crossings,
+// which are sorted and filled between as spans. Crossings are computed
+// from the edge's top, not accumulated, and row y is sampled at y + dy,
+// so filling into a band moved up by dy rows gives the same pixels as
+// filling the whole canvas.
+void fill_polygon(BMP& bmp, const PolyPoint* pts, const uint32_t* ring_start, size_t rings, const color& c,
+                  FillRule rule, const Rect& clip, int dy = 0) {
+    struct Edge {
+        double x, y, dxdy; // top end, and x step per row
+        long long first, last; // rows sampled, in undisplaced coordinates
+        int dir;           // +1 going down, -1 going up
+    };
+    thread_local std::vector<Edge> edges;
+    thread_local std::vector<uint32_t> active;
+    thread_local std::vector<std::pair<double, int>> cross;
+    edges.clear();
+    active.clear();
+
+    const long long row0 = static_cast<long long>(clip.y0) + dy, row1 = static_cast<long long>(clip.y1) + dy;
+    for (size_t r = 0; r < rings; ++r) {
+        uint32_t begin = ring_start[r], end = ring_start[r + 1];
+        for (uint32_t i = begin; i < end; ++i) {
+            const PolyPoint& a = pts[i];
+            const PolyPoint& b = pts[i + 1 < end ? i + 1 : begin];
+            if (a.y == b.y) continue;
+            const PolyPoint& top = a.y < b.y ? a : b;
+            const PolyPoint& bottom = a.y < b.y ? b : a;
+            // Rows whose center is in [top.y, bottom.y)
+            Edge e{top.x, top.y, (bottom.x - top.x) / (bottom.y - top.y), -floor_ll(0.5 - top.y),
+                   -floor_ll(0.5 - bottom.y) - 1, a.y < b.y ? 1 : -1};
+            e.first = std::max(e.first, row0);
+            e.last = std::min(e.last, row1 - 1);
+            if (e.first <= e.last) edges.push_back(e);
+        }
+    }
+    if (edges.empty()) return;
+    std::sort(edges.begin(), edges.end(), [](const Edge& a, const Edge& b) { return a.first < b.first; });
+
+    const bool rgb = bmp.bits_per_pixel() == 24;
+    const uint32_t ink = bmp.ink(c);
+    auto span = [&](int y, double x0, double x1) {
+        // Pixels whose center is in [x0, x1)
+        x0 = std::max(x0, clip.x0 - 1.0);
+        x1 = std::min(x1, clip.x1 + 1.0);
+        int xa = static_cast<int>(std::max<long long>(clip.x0, -floor_ll(0.5 - x0)));
+        int xb = static_cast<int>(std::min<long long>(clip.x1, -floor_ll(0.5 - x1)));
+        if (xa >= xb) return;
+        if (rgb) {
+            uint8_t* p = bmp.row(y) + 3 * xa;
+            for (int x = xa; x < xb; ++x, p += 3) {
+                p[0] = static_cast<uint8_t>(ink);
+                p[1] = static_cast<uint8_t>(ink >> 8);
+                p[2] = static_cast<uint8_t>(ink >> 16);
+            }
+        } else if (bmp.bits_per_pixel() == 8) {
+            std::memset(bmp.row(y) + xa, static_cast<int>(ink), xb - xa);
+        } else {
+            for (int x = xa; x < xb; ++x) bmp.put_pixel(x, y, ink);
+        }
+    };
+
+    size_t next = 0;
+    for (long long row = edges.front().first; row < row1; ++row) {
+        // Edges starting on this row join, finished ones leave
+        while (next < edges.size() && edges[next].first <= row) active.push_back(static_cast<uint32_t>(next++));
+        active.erase(std::remove_if(active.begin(), active.end(), [&](uint32_t e) { return edges[e].last < row; }),
+                     active.end());
+        if (active.empty()) {
+            if (next == edges.size()) break;
+            continue;
+        }
+
+        const double cy = row + 0.5;
+        cross.clear();
+        for (uint32_t i : active) {
+            const Edge& e = edges[i];
+            cross.push_back({e.x + (cy - e.y) * e.dxdy, e.dir});
+        }
+        std::sort(cross.begin(), cross.end());
+
+        int y = static_cast<int>(row - dy);
+        if (rule == FillRule::EvenOdd) {
+            for (size_t i = 0; i + 1 < cross.size(); i += 2) span(y, cross[i].first, cross[i + 1].first);
+        } else {
+            int winding = 0;
+            for (size_t i = 0; i + 1 < cross.size(); ++i) {
+                winding += cross[i].second;
+                if (winding != 0) span(y, cross[i].first, cross[i + 1].first);
+            }
+        }
+    }
+}
+
+void fill_polygon(BMP& bmp, const PolyPoint* pts, const uint32_t* ring_start, size_t rings, const color& c,
+                  FillRule rule) {
+    fill_polygon(bmp, pts, ring_start, rings, c, rule, Rect{0, 0, bmp.get_width(), bmp.get_height()});
+}
+
+
 #endif // BMP_HPP
\ No newline at end of file
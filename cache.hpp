@@ -0,0 +1,86 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+// Least recently used cache of encoded responses under a byte budget.
+// Values are shared and immutable, so a hit is handed out without
+// copying and stays valid after the lock is released, even if it is
+// evicted while being sent. Safe to use from many threads.
+class LruCache {
+public:
+    using Value = std::shared_ptr<const std::string>;
+
+    struct Stats {
+        uint64_t hits{0}, misses{0}, evictions{0};
+        size_t entries{0}, bytes{0}, budget{0};
+    };
+
+    explicit LruCache(size_t budget_bytes) : budget(budget_bytes) {}
+
+    // The value for key, now the most recently used, or null
+    Value get(const std::string& key) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = index.find(key);
+        if (it == index.end()) {
+            ++misses;
+            return nullptr;
+        }
+        ++hits;
+        entries.splice(entries.begin(), entries, it->second);
+        return it->second->value;
+    }
+
+    // Store value under key, evicting the least recently used entries
+    // until it fits. A value larger than the whole budget is not kept.
+    void put(const std::string& key, Value value) {
+        size_t cost = charge(key, *value);
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = index.find(key);
+        if (it != index.end()) {
+            bytes -= it->second->cost;
+            entries.erase(it->second);
+            index.erase(it);
+        }
+        if (cost > budget) return;
+        while (bytes + cost > budget) {
+            const Entry& last = entries.back();
+            bytes -= last.cost;
+            index.erase(last.key);
+            entries.pop_back();
+            ++evictions;
+        }
+        entries.push_front({key, std::move(value), cost});
+        index.emplace(key, entries.begin());
+        bytes += cost;
+    }
+
+    Stats stats() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return {hits, misses, evictions, index.size(), bytes, budget};
+    }
+
+private:
+    struct Entry {
+        std::string key;
+        Value value;
+        size_t cost;
+    };
+
+    // Bytes an entry holds: its key twice (list and index), the value and
+    // the bookkeeping around them
+    static size_t charge(const std::string& key, const std::string& value) {
+        return 2 * key.size() + value.size() + 128;
+    }
+
+    size_t budget;
+    size_t bytes{0};
+    uint64_t hits{0}, misses{0}, evictions{0};
+    std::list<Entry> entries; // most recently used first
+    std::unordered_map<std::string, std::list<Entry>::iterator> index;
+    mutable std::mutex mutex;
+};
@@ -0,0 +1,172 @@
+#pragma once
+#include <cctype>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "tags.hpp"
+
+// Tag filter expression, compiled against a TagDict so that matching an
+// element is integer comparisons only. Grammar:
+//
+//   expr   := and ('or' and)*
+//   and    := unary ('and' unary)*
+//   unary  := 'not' unary | '(' expr ')' | term
+//   term   := key | key '=*' | key '=' values | key '!=' values
+//   values := value ('|' value)*
+//
+// A bare key is the same as key=*. key!=v matches elements without key
+// too, as in Overpass; "key and key!=v" needs the key. Keys and values
+// may be double quoted.
+// Example: highway=* and not highway=footway|path
+class TagFilter {
+public:
+    TagFilter() = default;
+
+    TagFilter(std::string_view expr, TagDict& dict) {
+        src = expr;
+        pos = 0;
+        if (skip_ws(), pos == src.size()) return; // empty filter matches all
+        root = parse_or(dict);
+        skip_ws();
+        if (pos != src.size())
+            throw std::runtime_error("Unexpected '" + std::string(src.substr(pos)) + "' in filter");
+    }
+
+    bool empty() const { return root < 0; }
+
+    bool match(const Tag* begin, const Tag* end) const {
+        return root < 0 || eval(root, begin, end);
+    }
+
+    bool match(const TagStore& store, TagRange r) const {
+        const Tag* t = store.tags.data() + r.begin;
+        return match(t, t + r.count);
+    }
+
+private:
+    enum class Op { Any, Eq, Ne, Not, And, Or };
+
+    struct Expr {
+        Op op;
+        uint32_t key{TagDict::NONE};
+        std::vector<uint32_t> values;
+        int a{-1};
+        int b{-1};
+    };
+
+    std::vector<Expr> exprs;
+    int root{-1};
+
+    // Parser state, only used while compiling
+    std::string_view src;
+    size_t pos{0};
+
+    bool eval(int i, const Tag* begin, const Tag* end) const {
+        const Expr& e = exprs[i];
+        switch (e.op) {
+        case Op::Not: return !eval(e.a, begin, end);
+        case Op::And: return eval(e.a, begin, end) && eval(e.b, begin, end);
+        case Op::Or: return eval(e.a, begin, end) || eval(e.b, begin, end);
+        default: break;
+        }
+        for (const Tag* t = begin; t != end; ++t) {
+            if (t->key != e.key) continue;
+            if (e.op == Op::Any) return true;
+            bool listed = false;
+            for (uint32_t v : e.values) listed |= (v == t->value);
+            return e.op == Op::Eq ? listed : !listed;
+        }
+        return e.op == Op::Ne; // without the key, no value is listed
+    }
+
+    int add(Expr e) {
+        exprs.push_back(std::move(e));
+        return static_cast<int>(exprs.size()) - 1;
+    }
+
+    void skip_ws() {
+        while (pos < src.size() && std::isspace(static_cast<unsigned char>(src[pos]))) ++pos;
+    }
+
+    // Consume keyword w if it is the next whole word
+    bool keyword(std::string_view w) {
+        skip_ws();
+        if (src.compare(pos, w.size(), w) != 0) return false;
+        size_t end = pos + w.size();
+        if (end < src.size() && (std::isalnum(static_cast<unsigned char>(src[end])) || src[end] == '_' || src[end] == ':'))
+            return false;
+        pos = end;
+        return true;
+    }
+
+    std::string_view word() {
+        skip_ws();
+        if (pos < src.size() && src[pos] == '"') {
+            size_t close = src.find('"', pos + 1);
+            if (close == std::string_view::npos) throw std::runtime_error("Unterminated quote in filter");
+            std::string_view w = src.substr(pos + 1, close - pos - 1);
+            pos = close + 1;
+            return w;
+        }
+        size_t start = pos;
+        while (pos < src.size() && !std::isspace(static_cast<unsigned char>(src[pos])) &&
+               src[pos] != '=' && src[pos] != '!' && src[pos] != '|' && src[pos] != '(' && src[pos] != ')')
+            ++pos;
+        if (start == pos) throw std::runtime_error("Expected tag key or value in filter at " + std::to_string(pos));
+        return src.substr(start, pos - start);
+    }
+
+    int parse_or(TagDict& dict) {
+        int l = parse_and(dict);
+        while (keyword("or")) l = add({Op::Or, TagDict::NONE, {}, l, parse_and(dict)});
+        return l;
+    }
+
+    int parse_and(TagDict& dict) {
+        int l = parse_unary(dict);
+        while (keyword("and")) l = add({Op::And, TagDict::NONE, {}, l, parse_unary(dict)});
+        return l;
+    }
+
+    int parse_unary(TagDict& dict) {
+        if (keyword("not")) return add({Op::Not, TagDict::NONE, {}, parse_unary(dict), -1});
+        skip_ws();
+        if (pos < src.size() && src[pos] == '(') {
+            ++pos;
+            int e = parse_or(dict);
+            skip_ws();
+            if (pos >= src.size() || src[pos] != ')') throw std::runtime_error("Missing ')' in filter");
+            ++pos;
+            return e;
+        }
+        return parse_term(dict);
+    }
+
+    int parse_term(TagDict& dict) {
+        Expr e{Op::Any, TagDict::NONE, {}, -1, -1};
+        e.key = dict.intern(word());
+        skip_ws();
+        if (src.compare(pos, 2, "!=") == 0) {
+            e.op = Op::Ne;
+            pos += 2;
+        } else if (pos < src.size() && src[pos] == '=') {
+            e.op = Op::Eq;
+            ++pos;
+        } else {
+            return add(std::move(e));
+        }
+        skip_ws();
+        if (e.op == Op::Eq && pos < src.size() && src[pos] == '*') {
+            ++pos;
+            e.op = Op::Any;
+            return add(std::move(e));
+        }
+        e.values.push_back(dict.intern(word()));
+        while (skip_ws(), pos < src.size() && src[pos] == '|') {
+            ++pos;
+            e.values.push_back(dict.intern(word()));
+        }
+        return add(std::move(e));
+    }
+};
@@ -4,6 +4,7 @@
 #include <vector> // dynamic array
 #include <string> // 
 #include <cmath>
+#include <algorithm>
 
 const double EARTH_RADIUS_KM = 6371.0;
 
@@ -28,110 +29,50 @@ double haversine(double lat1, double lon1, double lat2, double lon2) {
 }
 
 
-#include "tinyxml2.h"
+#include "osm.hpp"
 
-using namespace tinyxml2;
-
-struct Node {
-    //long long id;
-    double lat, lon;
-};
-
-struct Way {
-    std::vector<long long> node_refs;
-    bool is_highway = false;
-    bool is_one_way = false;
-    std::string name; // To store the road name if available
-};
-
-struct Edge {
-    long long node1, node2;
-    std::string label;
-};
-
-std::map<long long, Node> nodes;
-std::vector<Way> ways;
 struct EdgeInfo {
     std::string road_name;
     double distance_km;
 };
 
+OsmData osm;
 std::unordered_map<long long, std::unordered_map<long long, EdgeInfo>> graph;
 
-double min_lat = 1e9, max_lat = -1e9;
-double min_lon = 1e9, max_lon = -1e9;
-
-void parse_osm(const char* filename) {
-    XMLDocument doc;
-    if (doc.LoadFile(filename) != XML_SUCCESS)
-        throw std::runtime_error("Failed to read OSM file");
-
-    XMLElement* root = doc.RootElement();
-    for (XMLElement* elem = root->FirstChildElement(); elem; elem = elem->NextSiblingElement()) {
-        std::string tagName = elem->Name();
-        if (tagName == "node") {
-            long long id = std::stoll(elem->Attribute("id"));
-            double lat = std::stod(elem->Attribute("lat"));
-            double lon = std::stod(elem->Attribute("lon"));
-            nodes[id] = {lat, lon};
-            min_lat = std::min(min_lat, lat);
-            max_lat = std::max(max_lat, lat);
-            min_lon = std::min(min_lon, lon);
-            max_lon = std::max(max_lon, lon);
-        } else if (tagName == "way") {
-            Way way;
-            bool is_hw = false;
-            for (XMLElement* child = elem->FirstChildElement(); child; child = child->NextSiblingElement()) {
-                std::string childName = child->Name();
-                if (childName == "nd") {
-                    long long ref = std::stoll(child->Attribute("ref"));
-                    way.node_refs.push_back(ref);
-                } else if (childName == "tag") {
-                    const char* k = child->Attribute("k");
-                    const char* v = child->Attribute("v");
-                    if (k && std::string(k) == "highway") {
-                        is_hw = true;
-                    }
-                    if (k && std::string(k) == "name") {
-                        way.name = v ? v : "";
-                    }
-                    if (k && std::string(k) == "oneway" && std::string(v)=="yes") {
-                        way.is_one_way=true;
-                    }
-                    
-                }
-            }
-            way.is_highway = is_hw;
-            if(way.is_highway){
-                ways.push_back(way);
-
-            // Add edges to the graph (undirected)
-            for (size_t i = 1; i < way.node_refs.size(); ++i) {
-                long long node1 = way.node_refs[i - 1];
-                long long node2 = way.node_refs[i];
-                if (nodes.count(node1) && nodes.count(node2)) {
-                    double lat1 = nodes[node1].lat;
-                    double lon1 = nodes[node1].lon;
-                    double lat2 = nodes[node2].lat;
-                    double lon2 = nodes[node2].lon;
-                
-                    double dist = haversine(lat1, lon1, lat2, lon2);
-                
-                    graph[node1][node2] = {way.name, dist};
-                    if (!way.is_one_way)
-                        graph[node2][node1] = {way.name, dist};
-                }
-                
-            }//for
-           }// is_highway
-        }//way
-    } //main loop
+void build_graph() {
+    const uint32_t k_name = osm.tags.dict.intern("name");
+    const uint32_t k_oneway = osm.tags.dict.intern("oneway");
+    const uint32_t v_yes = osm.tags.dict.intern("yes");
+
+    for (const Way& way : osm.ways) {
+        std::string name(osm.tags.dict.str(osm.tags.get(way.tags, k_name)));
+        bool is_one_way = osm.tags.has(way.tags, k_oneway, v_yes);
+        const uint32_t* refs = osm.way_begin(way);
+
+        // Add edges to the graph (undirected)
+        for (size_t i = 1; i < way.node_count; ++i) {
+            uint32_t a = refs[i - 1];
+            uint32_t b = refs[i];
+            if (a == NO_NODE || b == NO_NODE) continue;
+
+            const Node& n1 = osm.nodes[a];
+            const Node& n2 = osm.nodes[b];
+            double dist = haversine(n1.lat, n1.lon, n2.lat, n2.lon);
+
+            long long node1 = osm.node_ids[a];
+            long long node2 = osm.node_ids[b];
+            graph[node1][node2] = {name, dist};
+            if (!is_one_way)
+                graph[node2][node1] = {name, dist};
+        }
+    }
 }
 
 
 void print_graph() {
     for (const auto& node : graph) {
-        std::cout << "Node " << nodes[node.first].lat << " " << nodes[node.first].lon << "\n";
+        const Node& n = osm.nodes[osm.find_node(node.first)];
+        std::cout << "Node " << n.lat << " " << n.lon << "\n";
         for (const auto& edge : node.second) {
             std::cout << "Edge: " << node.first << " <-> " << edge.first 
                       << " (Road: " << edge.second.road_name 
@@ -141,12 +82,10 @@ void print_graph() {
 }
 
 void print_distance_between_nodes(long long node1, long long node2) {
-    if (nodes.count(node1) && nodes.count(node2)) {
-        double lat1 = nodes[node1].lat;
-        double lon1 = nodes[node1].lon;
-        double lat2 = nodes[node2].lat;
-        double lon2 = nodes[node2].lon;
-        double dist = haversine(lat1, lon1, lat2, lon2);
+    uint32_t a = osm.find_node(node1);
+    uint32_t b = osm.find_node(node2);
+    if (a != NO_NODE && b != NO_NODE) {
+        double dist = haversine(osm.nodes[a].lat, osm.nodes[a].lon, osm.nodes[b].lat, osm.nodes[b].lon);
         std::cout << "Distance between node " << node1 << " and " << node2 << ": " << dist << " km\n";
     } else {
         std::cout << "One or both nodes not found.\n";
@@ -155,14 +94,18 @@ void print_distance_between_nodes(long long node1, long long node2) {
 
 
 int main(int argc, char* argv[]) {
-    if (argc != 2) {
-        std::cerr << "Usage: " << argv[0] << " <input.osm> \n";
+    if (argc != 2 && argc != 3) {
+        std::cerr << "Usage: " << argv[0] << " <input.osm> [filter]\n";
+        std::cerr << "  filter defaults to \"highway=*\", e.g. \"highway=* and not highway=footway\"\n";
         return 1;
     }
 
     const char* input_file = argv[1];
+    TagFilter filter(argc == 3 ? argv[2] : "highway=*", osm.tags.dict);
 
-    parse_osm(input_file);
+    // Only nodes on the selected ways are materialized; areas are not needed
+    load_osm(input_file, filter, LoadMode::ReferencedNodes, osm, false);
+    build_graph();
 
     // Print the graph with edge labels
     print_graph();
@@ -3,94 +3,158 @@
 #include <map>
 #include <vector>
 #include <string>
+#include <cstdio>
+#include <algorithm>
+#include <numeric>
+#include <cmath>
 
-#include "tinyxml2.h"
 #include "svg.hpp"
-using namespace tinyxml2;
-
-struct Node {
-    double lat, lon;
-};
-
-struct Way {
-    std::vector<long long> node_refs;
-    bool is_highway = false;
-};
-
-std::map<long long, Node> nodes;
-std::vector<Way> ways;
-
-double min_lat = 1e9, max_lat = -1e9;
-double min_lon = 1e9, max_lon = -1e9;
-
-void parse_osm(const char* filename) {
-    XMLDocument doc;
-    if (doc.LoadFile(filename) != XML_SUCCESS)
-        throw std::runtime_error("Failed to read OSM file");
-
-    XMLElement* root = doc.RootElement();
-    for (XMLElement* elem = root->FirstChildElement(); elem; elem = elem->NextSiblingElement()) {
-        std::string tagName = elem->Name();
-        if (tagName == "node") {
-            long long id = std::stoll(elem->Attribute("id"));
-            double lat = std::stod(elem->Attribute("lat"));
-            double lon = std::stod(elem->Attribute("lon"));
-            nodes[id] = {lat, lon};
-            min_lat = std::min(min_lat, lat);
-            max_lat = std::max(max_lat, lat);
-            min_lon = std::min(min_lon, lon);
-            max_lon = std::max(max_lon, lon);
-        } else if (tagName == "way") {
-            Way way;
-            bool is_hw = false;
-            for (XMLElement* child = elem->FirstChildElement(); child; child = child->NextSiblingElement()) {
-                std::string childName = child->Name();
-                if (childName == "nd") {
-                    long long ref = std::stoll(child->Attribute("ref"));
-                    way.node_refs.push_back(ref);
-                } else if (childName == "tag") {
-                    const char* k = child->Attribute("k");
-                    const char* v = child->Attribute("v");
-                    if (k && std::string(k) == "highway") {
-                        is_hw = true;
-                    }
-                }
-            }
-            way.is_highway = is_hw;
-            ways.push_back(way);
-        }
-    }
-}
+#include "projection.hpp"
+#include "scene.hpp"
+#include "osm.hpp"
+#include "spatial.hpp"
+#include "style.hpp"
+#include "simplify.hpp"
+#include "threadpool.hpp"
 
-int scale(double value, double minv, double maxv, int size) {
-    return static_cast<int>((value - minv) / (maxv - minv) * (size - 1));
-}
+OsmData osm;
 
 int main(int argc, char* argv[]) {
-    if (argc != 3) {
-        std::cerr << "Usage: " << argv[0] << " <input.osm> <output.bmp>\n";
+    if (argc < 3) {
+        std::cerr << "Usage: " << argv[0] << " <input.osm> <output.svg> [filter] [--simplify PX] [--threads N]\n"
+                  << "         [--projection mercator|linear] [--style FILE]\n"
+                  << "         [--bbox min_lon,min_lat,max_lon,max_lat | --center lat,lon --zoom Z]\n";
         return 1;
     }
 
     const char* input_file = argv[1];
     const char* output_file = argv[2];
-
-    parse_osm(input_file);
+    std::string filter_expr;
+    bool has_bbox = false, has_center = false;
+    BBox view{};
+    double center_lat = 0, center_lon = 0, zoom = -1;
     int width = 2000, height = 2000;
+    double tolerance = 0; // pixels, 0 keeps every node
+    unsigned threads = 0;
+    Projection projection = Projection::Mercator;
+    std::string style_file;
+
+    for (int i = 3; i < argc; ++i) {
+        std::string opt = argv[i];
+        if (opt == "--bbox" && i + 1 < argc) {
+            view = parse_bbox(argv[++i]);
+            has_bbox = true;
+        } else if (opt == "--center" && i + 1 < argc) {
+            if (std::sscanf(argv[++i], "%lf,%lf", &center_lat, &center_lon) != 2) {
+                std::cerr << "Invalid --center, expected lat,lon\n";
+                return 1;
+            }
+            has_center = true;
+        } else if (opt == "--zoom" && i + 1 < argc) {
+            zoom = std::stod(argv[++i]);
+        } else if (opt == "--simplify" && i + 1 < argc) {
+            tolerance = std::stod(argv[++i]);
+        } else if (opt == "--projection" && i + 1 < argc) {
+            projection = parse_projection(argv[++i]);
+        } else if (opt == "--style" && i + 1 < argc) {
+            style_file = argv[++i];
+        } else if (opt == "--threads" && i + 1 < argc) {
+            threads = std::stoul(argv[++i]);
+        } else if (opt.rfind("--", 0) != 0 && filter_expr.empty()) {
+            filter_expr = opt;
+        } else {
+            std::cerr << "Unknown option: " << opt << "\n";
+            return 1;
+        }
+    }
+    if (has_center != (zoom >= 0)) {
+        std::cerr << "--center and --zoom go together\n";
+        return 1;
+    }
+    if (has_center) {
+        view = bbox_around(center_lat, center_lon, zoom, width, height);
+        has_bbox = true;
+    }
+
+    TagFilter filter(filter_expr, osm.tags.dict);
+
+    // With a filter only the nodes of matching ways are loaded
+    load_osm(input_file, filter, filter.empty() ? LoadMode::AllNodes : LoadMode::ReferencedNodes, osm);
+
+    BBox bounds = has_bbox ? view : BBox{osm.min_lon, osm.min_lat, osm.max_lon, osm.max_lat};
+    View frame = View::fit(projection, bounds, width, height);
+
+    // Every node projected once, then simplified in picture pixels
+    ThreadPool pool(threads);
+    std::vector<ScreenPoint> px = project_nodes(osm.nodes, frame, pool);
+    SimplifiedWays simple = simplify_ways(osm, px, tolerance, pool);
+
+    // One CSS class per style, so paths name their style instead of
+    // repeating it
+    StyleSheet sheet = style_file.empty() ? StyleSheet::defaults() : StyleSheet::load(style_file);
+    WayStyles styles = style_ways(osm, sheet, pool);
+
     svg image(output_file,width, height);
 
-    for (const auto& way : ways) {
-        for (size_t i = 1; i < way.node_refs.size(); ++i) {
-            auto it1 = nodes.find(way.node_refs[i - 1]);
-            auto it2 = nodes.find(way.node_refs[i]);
-            if (it1 == nodes.end() || it2 == nodes.end()) continue;
-            int x1 = scale(it1->second.lon, min_lon, max_lon, width);
-            int y1 = height - scale(it1->second.lat, min_lat, max_lat, height);
-            int x2 = scale(it2->second.lon, min_lon, max_lon, width);
-            int y2 = height - scale(it2->second.lat, min_lat, max_lat, height);
-            color clr = way.is_highway ? color(255, 0, 0) : color(0, 0, 0);
-            image.draw_line( x1, y1, x2, y2, clr);
+    std::vector<int> style_class, fill_class;
+    for (size_t i = 0; i < styles.styles.size(); ++i) {
+        const Style& s = styles.styles[i];
+        style_class.push_back(image.define_class("s" + std::to_string(i), s.stroke, s.width));
+        fill_class.push_back(s.filled ? image.define_fill_class("f" + std::to_string(i), s.fill) : -1);
+    }
+
+    // Kept nodes first..last of way w as paths, split where a node is missing
+    std::vector<svg::point> pts;
+    auto draw_run = [&](uint32_t w, uint32_t first, uint32_t last) {
+        if (!styles.stroked(w)) return;
+        int cls = style_class[styles.way_style[w]];
+        pts.clear();
+        for (uint32_t k = first; k <= last; ++k) {
+            if (!simple.kept(k)) continue;
+            uint32_t n = osm.way_nodes[k];
+            if (n == NO_NODE) {
+                image.draw_polyline(pts, cls);
+                pts.clear();
+                continue;
+            }
+            pts.push_back({static_cast<int>(std::floor(px[n].x)), static_cast<int>(std::floor(px[n].y))});
         }
+        image.draw_polyline(pts, cls);
+    };
+
+    // A closed way, or all the rings of a multipolygon, as one filled path
+    std::vector<uint32_t> ring_start;
+    auto draw_area = [&](const WayStyles::Area& a) {
+        pts.clear();
+        ring_start.assign(1, 0);
+        for_each_ring_node(
+            osm, a, &simple,
+            [&](uint32_t n) {
+                pts.push_back({static_cast<int>(std::floor(px[n].x)), static_cast<int>(std::floor(px[n].y))});
+            },
+            [&] { ring_start.push_back(static_cast<uint32_t>(pts.size())); });
+        int cls = fill_class[a.relation ? styles.area_style[a.index] : styles.way_style[a.index]];
+        image.draw_polygon(pts, ring_start, cls);
+    };
+
+    if (has_bbox) {
+        // Only segments crossing the viewport, in file order within a
+        // layer, with the areas whole and once each under all the lines
+        SegmentIndex index(osm);
+        std::vector<uint32_t> visible;
+        index.query(view, [&](uint32_t k) { visible.push_back(k); });
+        std::sort(visible.begin(), visible.end());
+        for (const WayStyles::Area& a : areas_in_view(osm, styles, ClosedWayIndex(osm), MultipolygonIndex(osm), view))
+            draw_area(a);
+        for (const Run& run : visible_runs(osm, styles, visible, &simple)) draw_run(run.way, run.first, run.last);
+    } else {
+        // Areas under all the lines, then the lines; layers bottom up
+        std::vector<uint32_t> area_relations(osm.multipolygons.size());
+        std::iota(area_relations.begin(), area_relations.end(), 0);
+        for (const WayStyles::Area& a : styles.areas(osm, styles.order, area_relations)) draw_area(a);
+        for (uint32_t w : styles.order)
+            if (osm.ways[w].node_count > 1)
+                draw_run(w, osm.ways[w].node_begin, osm.ways[w].node_begin + osm.ways[w].node_count - 1);
     }
 
     return 0;
@@ -0,0 +1,57 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Set of OSM ids as a bitset over [min_id, max_id]. The range is split
+// into 64 Ki-id chunks that are only allocated once an id in them is
+// inserted, so sparse id ranges (node ids run into the billions) cost
+// one pointer per empty chunk instead of a bit per id.
+class IdBitset {
+public:
+    IdBitset() = default;
+
+    IdBitset(long long min_id, long long max_id) : base(min_id) {
+        if (max_id >= min_id)
+            chunks.resize(static_cast<size_t>((max_id - min_id) >> CHUNK_SHIFT) + 1);
+    }
+
+    void insert(long long id) {
+        unsigned long long off = static_cast<unsigned long long>(id - base);
+        size_t c = off >> CHUNK_SHIFT;
+        if (id < base || c >= chunks.size()) return;
+        if (!chunks[c]) {
+            chunks[c].reset(new uint64_t[CHUNK_WORDS]());
+            ++used_chunks;
+        }
+        uint32_t bit = off & (CHUNK_IDS - 1);
+        uint64_t& w = chunks[c][bit >> 6];
+        uint64_t m = uint64_t{1} << (bit & 63);
+        count += !(w & m);
+        w |= m;
+    }
+
+    bool contains(long long id) const {
+        unsigned long long off = static_cast<unsigned long long>(id - base);
+        size_t c = off >> CHUNK_SHIFT;
+        if (id < base || c >= chunks.size() || !chunks[c]) return false;
+        uint32_t bit = off & (CHUNK_IDS - 1);
+        return (chunks[c][bit >> 6] >> (bit & 63)) & 1;
+    }
+
+    size_t size() const { return count; }
+
+    size_t memory_bytes() const {
+        return chunks.size() * sizeof(chunks[0]) + used_chunks * CHUNK_WORDS * sizeof(uint64_t);
+    }
+
+private:
+    static constexpr int CHUNK_SHIFT = 16;
+    static constexpr uint32_t CHUNK_IDS = 1u << CHUNK_SHIFT;
+    static constexpr uint32_t CHUNK_WORDS = CHUNK_IDS / 64;
+
+    long long base{0};
+    std::vector<std::unique_ptr<uint64_t[]>> chunks;
+    size_t used_chunks{0};
+    size_t count{0};
+};
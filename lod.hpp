@@ -0,0 +1,409 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include "osm.hpp"
+#include "projection.hpp"
+#include "simplify.hpp"
+#include "threadpool.hpp"
+
+// Level-of-detail copies of way geometry for zoomed-out rendering.
+//
+// The level for zoom z is the data simplified to half a pixel of a 256 px
+// Web Mercator tile at z, with ways smaller than a pixel dropped. It is
+// good for any view at z or further out. Each level is a complete
+// OsmData holding just the surviving ways and multipolygon rings, their
+// kept nodes and their tags, so SegmentIndex and the renderers work on
+// it unchanged. Node tags are not kept, and the bounds are those of the full data so a
+// picture frames the same at every level.
+//
+// All levels go into one file after an index, so a render reads only
+// the level it needs. The file records the size and modification time
+// of the source and the filter it was built with; a mismatch makes it
+// stale and it is rebuilt. The file is written under a temporary name and
+// renamed into place when complete, so a reader never sees half of one.
+
+// Zooms that get a level by default
+inline const std::vector<int> LOD_ZOOMS{6, 8, 10, 12, 14};
+
+// What a LOD file was built from
+struct LodSource {
+    uint64_t size{0};
+    int64_t mtime{0};
+    std::string filter;
+};
+
+inline LodSource lod_source(const std::string& input_file, const std::string& filter_expr) {
+    LodSource s;
+    s.size = std::filesystem::file_size(input_file);
+    s.mtime = std::filesystem::last_write_time(input_file).time_since_epoch().count();
+    s.filter = filter_expr;
+    return s;
+}
+
+// Header of a LOD file: bounds of the full data and where each level is
+struct LodIndex {
+    struct Level {
+        int zoom;
+        uint64_t offset;
+    };
+    double min_lat, max_lat, min_lon, max_lon;
+    std::vector<Level> levels; // ascending zoom
+
+    // Coarsest level still detailed enough for zoom, or -1 if only the
+    // full data is
+    int level_for(double zoom) const {
+        for (size_t i = 0; i < levels.size(); ++i)
+            if (levels[i].zoom >= zoom) return static_cast<int>(i);
+        return -1;
+    }
+};
+
+namespace lod_detail {
+
+constexpr char MAGIC[8] = {'O', 'S', 'M', 'L', 'O', 'D', '3', '\0'};
+
+template <typename T>
+void put(std::ostream& out, const T& v) {
+    out.write(reinterpret_cast<const char*>(&v), sizeof(T));
+}
+
+template <typename T>
+void put_vector(std::ostream& out, const std::vector<T>& v) {
+    put<uint64_t>(out, v.size());
+    out.write(reinterpret_cast<const char*>(v.data()), v.size() * sizeof(T));
+}
+
+inline void put_string(std::ostream& out, std::string_view s) {
+    put<uint32_t>(out, static_cast<uint32_t>(s.size()));
+    out.write(s.data(), s.size());
+}
+
+template <typename T>
+T get(std::istream& in) {
+    T v{};
+    if (!in.read(reinterpret_cast<char*>(&v), sizeof(T))) throw std::runtime_error("Truncated LOD file");
+    return v;
+}
+
+// Throws unless count items of size bytes each fit between the read
+// position and end, so a corrupt length never sizes a huge allocation
+inline void check_fits(std::istream& in, uint64_t count, size_t size, uint64_t end) {
+    std::streamoff pos = in.tellg();
+    if (pos < 0 || static_cast<uint64_t>(pos) > end || count > (end - static_cast<uint64_t>(pos)) / size)
+        throw std::runtime_error("Corrupt LOD file");
+}
+
+template <typename T>
+void get_vector(std::istream& in, std::vector<T>& v, uint64_t end) {
+    uint64_t n = get<uint64_t>(in);
+    check_fits(in, n, sizeof(T), end);
+    v.resize(n);
+    if (!in.read(reinterpret_cast<char*>(v.data()), v.size() * sizeof(T)))
+        throw std::runtime_error("Truncated LOD file");
+}
+
+inline std::string get_string(std::istream& in, uint64_t end) {
+    uint32_t n = get<uint32_t>(in);
+    check_fits(in, n, 1, end);
+    std::string s(n, '\0');
+    if (!in.read(s.data(), s.size())) throw std::runtime_error("Truncated LOD file");
+    return s;
+}
+
+inline uint64_t file_size(std::istream& in) {
+    std::streamoff pos = in.tellg();
+    in.seekg(0, std::ios::end);
+    std::streamoff size = in.tellg();
+    in.seekg(pos);
+    return size < 0 ? 0 : static_cast<uint64_t>(size);
+}
+
+// Dictionary strings are written in id order, so interning them in order
+// into an empty dictionary gives back the same ids
+inline void write_level(std::ostream& out, const OsmData& data) {
+    put<uint32_t>(out, static_cast<uint32_t>(data.tags.dict.size()));
+    for (uint32_t i = 0; i < data.tags.dict.size(); ++i) put_string(out, data.tags.dict.str(i));
+    put_vector(out, data.tags.tags);
+    put_vector(out, data.node_ids);
+    put_vector(out, data.nodes);
+    put_vector(out, data.ways);
+    put_vector(out, data.way_nodes);
+    put_vector(out, data.multipolygons);
+    // Field by field, so padding never reaches the file
+    put<uint64_t>(out, data.rings.size());
+    for (const Ring& r : data.rings) put(out, r.node_begin), put(out, r.node_count), put<uint8_t>(out, r.inner);
+    put_vector(out, data.ring_nodes);
+    put(out, data.min_lat), put(out, data.max_lat), put(out, data.min_lon), put(out, data.max_lon);
+}
+
+// Throws unless every index in a level read from a file points into the
+// array it indexes and every node is on the globe, so corrupt contents
+// never reach the renderers.
+// Ways must be in way_nodes order, as way_at relies on.
+inline void check_level(const OsmData& data, uint32_t strings) {
+    auto fail = [] { throw std::runtime_error("Corrupt LOD file"); };
+    auto slice = [](uint32_t begin, uint32_t count, size_t size) { return uint64_t(begin) + count <= size; };
+    if (data.tags.dict.size() != strings || data.node_ids.size() != data.nodes.size()) fail();
+    for (const Tag& t : data.tags.tags)
+        if (t.key >= strings || t.value >= strings) fail();
+    for (const Node& n : data.nodes)
+        if (!(n.lat >= -90 && n.lat <= 90 && n.lon >= -180 && n.lon <= 180)) fail();
+    for (uint32_t n : data.way_nodes)
+        if (n != NO_NODE && n >= data.nodes.size()) fail();
+    for (uint32_t n : data.ring_nodes)
+        if (n != NO_NODE && n >= data.nodes.size()) fail();
+    uint32_t next = 0;
+    for (const Way& w : data.ways) {
+        if (w.node_begin < next || !slice(w.node_begin, w.node_count, data.way_nodes.size()) ||
+            !slice(w.tags.begin, w.tags.count, data.tags.tags.size()))
+            fail();
+        next = w.node_begin;
+    }
+    for (const Ring& r : data.rings)
+        if (!slice(r.node_begin, r.node_count, data.ring_nodes.size())) fail();
+    for (const Multipolygon& mp : data.multipolygons)
+        if (!slice(mp.ring_begin, mp.ring_count, data.rings.size()) ||
+            !slice(mp.tags.begin, mp.tags.count, data.tags.tags.size()))
+            fail();
+}
+
+// Level at the read position; every length is checked against end, the
+// size of the file, and every index by check_level
+inline void read_level(std::istream& in, OsmData& data, uint64_t end) {
+    uint32_t strings = get<uint32_t>(in);
+    check_fits(in, strings, sizeof(uint32_t), end);
+    for (uint32_t i = 0; i < strings; ++i) data.tags.dict.intern(get_string(in, end));
+    get_vector(in, data.tags.tags, end);
+    get_vector(in, data.node_ids, end);
+    get_vector(in, data.nodes, end);
+    get_vector(in, data.ways, end);
+    get_vector(in, data.way_nodes, end);
+    get_vector(in, data.multipolygons, end);
+    uint64_t rings = get<uint64_t>(in);
+    check_fits(in, rings, 2 * sizeof(uint32_t) + 1, end);
+    data.rings.resize(rings);
+    for (Ring& r : data.rings) {
+        r.node_begin = get<uint32_t>(in);
+        r.node_count = get<uint32_t>(in);
+        r.inner = get<uint8_t>(in) != 0;
+    }
+    get_vector(in, data.ring_nodes, end);
+    data.min_lat = get<double>(in), data.max_lat = get<double>(in);
+    data.min_lon = get<double>(in), data.max_lon = get<double>(in);
+    check_level(data, strings);
+}
+
+} // namespace lod_detail
+
+// The level of src for zoom: ways simplified to tolerance pixels of the
+// Mercator map at that zoom, and dropped if they fit within min_size
+// pixels both ways
+inline OsmData make_lod_level(const OsmData& src, int zoom, ThreadPool& pool, double tolerance = 0.5,
+                              double min_size = 1.0) {
+    std::vector<ScreenPoint> px = project_nodes(src.nodes, View::tiles(zoom), pool);
+    SimplifiedWays simple = simplify_ways(src, px, tolerance, pool);
+
+    // Ways that stay, and the nodes they still use
+    std::vector<uint8_t> keep_way(src.ways.size());
+    std::vector<uint8_t> used(src.nodes.size());
+    pool.parallel_for(src.ways.size(), [&](size_t w) {
+        const Way& way = src.ways[w];
+        double x0 = 1e300, y0 = 1e300, x1 = -1e300, y1 = -1e300;
+        for (uint32_t k = way.node_begin; k < way.node_begin + way.node_count; ++k) {
+            if (src.way_nodes[k] == NO_NODE) continue;
+            const ScreenPoint& p = px[src.way_nodes[k]];
+            x0 = std::min(x0, p.x), x1 = std::max(x1, p.x);
+            y0 = std::min(y0, p.y), y1 = std::max(y1, p.y);
+        }
+        keep_way[w] = x1 - x0 >= min_size || y1 - y0 >= min_size;
+    });
+    for (size_t w = 0; w < src.ways.size(); ++w) {
+        if (!keep_way[w]) continue;
+        for (uint32_t k = src.ways[w].node_begin; k < src.ways[w].node_begin + src.ways[w].node_count; ++k)
+            if (simple.kept(k) && src.way_nodes[k] != NO_NODE) used[src.way_nodes[k]] = 1;
+    }
+
+    // Rings alike, over their present nodes; a ring left with fewer than
+    // three distinct nodes is dropped
+    std::vector<uint8_t> keep_ring_node(src.ring_nodes.size());
+    std::vector<uint8_t> keep_ring(src.rings.size());
+    pool.parallel_for(src.rings.size(), [&](size_t r) {
+        const Ring& ring = src.rings[r];
+        std::vector<ScreenPoint> pts;
+        std::vector<uint32_t> pos;
+        for (uint32_t k = ring.node_begin; k < ring.node_begin + ring.node_count; ++k) {
+            if (src.ring_nodes[k] == NO_NODE) continue;
+            pts.push_back(px[src.ring_nodes[k]]);
+            pos.push_back(k);
+        }
+        if (pts.size() < 4) return;
+        double x0 = 1e300, y0 = 1e300, x1 = -1e300, y1 = -1e300;
+        for (const ScreenPoint& p : pts) {
+            x0 = std::min(x0, p.x), x1 = std::max(x1, p.x);
+            y0 = std::min(y0, p.y), y1 = std::max(y1, p.y);
+        }
+        if (x1 - x0 < min_size && y1 - y0 < min_size) return;
+        std::vector<uint8_t> keep(pts.size());
+        std::vector<std::pair<uint32_t, uint32_t>> stack;
+        simplify_detail::douglas_peucker(pts, tolerance, keep.data(), stack);
+        size_t kept = 0;
+        for (size_t i = 0; i < pts.size(); ++i) kept += keep_ring_node[pos[i]] = keep[i];
+        keep_ring[r] = kept >= 4;
+    });
+    for (size_t r = 0; r < src.rings.size(); ++r) {
+        if (!keep_ring[r]) continue;
+        for (uint32_t k = src.rings[r].node_begin; k < src.rings[r].node_begin + src.rings[r].node_count; ++k)
+            if (keep_ring_node[k]) used[src.ring_nodes[k]] = 1;
+    }
+
+    // Used nodes keep their id order, so node_ids stays sorted
+    OsmData out;
+    std::vector<uint32_t> remap(src.nodes.size(), NO_NODE);
+    for (size_t i = 0; i < src.nodes.size(); ++i) {
+        if (!used[i]) continue;
+        remap[i] = static_cast<uint32_t>(out.nodes.size());
+        out.node_ids.push_back(src.node_ids[i]);
+        out.nodes.push_back(src.nodes[i]);
+    }
+    for (size_t w = 0; w < src.ways.size(); ++w) {
+        if (!keep_way[w]) continue;
+        const Way& way = src.ways[w];
+        Way copy = way;
+        copy.node_begin = static_cast<uint32_t>(out.way_nodes.size());
+        for (uint32_t k = way.node_begin; k < way.node_begin + way.node_count; ++k)
+            if (simple.kept(k))
+                out.way_nodes.push_back(src.way_nodes[k] == NO_NODE ? NO_NODE : remap[src.way_nodes[k]]);
+        copy.node_count = static_cast<uint32_t>(out.way_nodes.size()) - copy.node_begin;
+
+        uint32_t begin = out.tags.open();
+        for (uint32_t t = way.tags.begin; t < way.tags.begin + way.tags.count; ++t)
+            out.tags.add(src.tags.dict.str(src.tags.tags[t].key), src.tags.dict.str(src.tags.tags[t].value));
+        copy.tags = out.tags.close(begin);
+        out.ways.push_back(copy);
+    }
+    for (const Multipolygon& mp : src.multipolygons) {
+        Multipolygon copy = mp;
+        copy.ring_begin = static_cast<uint32_t>(out.rings.size());
+        for (uint32_t r = mp.ring_begin; r < mp.ring_begin + mp.ring_count; ++r) {
+            if (!keep_ring[r]) continue;
+            Ring ring = src.rings[r];
+            ring.node_begin = static_cast<uint32_t>(out.ring_nodes.size());
+            for (uint32_t k = src.rings[r].node_begin; k < src.rings[r].node_begin + src.rings[r].node_count; ++k)
+                if (keep_ring_node[k]) out.ring_nodes.push_back(remap[src.ring_nodes[k]]);
+            ring.node_count = static_cast<uint32_t>(out.ring_nodes.size()) - ring.node_begin;
+            out.rings.push_back(ring);
+        }
+        copy.ring_count = static_cast<uint32_t>(out.rings.size()) - copy.ring_begin;
+        if (copy.ring_count == 0) continue;
+
+        uint32_t begin = out.tags.open();
+        for (uint32_t t = mp.tags.begin; t < mp.tags.begin + mp.tags.count; ++t)
+            out.tags.add(src.tags.dict.str(src.tags.tags[t].key), src.tags.dict.str(src.tags.tags[t].value));
+        copy.tags = out.tags.close(begin);
+        out.multipolygons.push_back(copy);
+    }
+    out.min_lat = src.min_lat, out.max_lat = src.max_lat;
+    out.min_lon = src.min_lon, out.max_lon = src.max_lon;
+    return out;
+}
+
+// Build a level of data for each of zooms and write them all to file
+inline void write_lod(const std::string& file, const LodSource& source, const OsmData& data,
+                      const std::vector<int>& zooms, ThreadPool& pool) {
+    using namespace lod_detail;
+    // A name of this process's own, so builds running at once do not
+    // write into each other's file
+    std::string temp = file + ".tmp" + std::to_string(getpid());
+    std::ofstream out(temp, std::ios::binary);
+    if (!out) throw std::runtime_error("Failed to open LOD file " + temp);
+
+    std::vector<int> sorted(zooms);
+    std::sort(sorted.begin(), sorted.end());
+    out.write(MAGIC, sizeof(MAGIC));
+    put(out, source.size);
+    put(out, source.mtime);
+    put_string(out, source.filter);
+    put(out, data.min_lat), put(out, data.max_lat), put(out, data.min_lon), put(out, data.max_lon);
+    put<uint32_t>(out, static_cast<uint32_t>(sorted.size()));
+    std::streampos table = out.tellp();
+    for (int z : sorted) put<int32_t>(out, z), put<uint64_t>(out, 0);
+    put<uint64_t>(out, 0);
+
+    // Offsets and the file length are filled in once the levels are written
+    std::vector<uint64_t> offsets;
+    for (int z : sorted) {
+        offsets.push_back(static_cast<uint64_t>(out.tellp()));
+        write_level(out, make_lod_level(data, z, pool));
+    }
+    uint64_t length = static_cast<uint64_t>(out.tellp());
+    out.seekp(table);
+    for (size_t i = 0; i < sorted.size(); ++i) put<int32_t>(out, sorted[i]), put<uint64_t>(out, offsets[i]);
+    put(out, length);
+    out.close();
+    std::error_code error;
+    if (!out || (std::filesystem::rename(temp, file, error), error)) {
+        std::filesystem::remove(temp, error);
+        throw std::runtime_error("Failed to write LOD file " + file);
+    }
+}
+
+// Read the index of a LOD file. Returns false if the file is missing,
+// truncated or corrupt, or was built from a different source or filter.
+inline bool read_lod_index(const std::string& file, const LodSource& source, LodIndex& index) {
+    using namespace lod_detail;
+    std::ifstream in(file, std::ios::binary);
+    char magic[sizeof(MAGIC)];
+    if (!in || !in.read(magic, sizeof(magic)) || !std::equal(magic, magic + sizeof(magic), MAGIC)) return false;
+    try {
+        uint64_t end = file_size(in);
+        if (get<uint64_t>(in) != source.size || get<int64_t>(in) != source.mtime ||
+            get_string(in, end) != source.filter)
+            return false;
+        index.min_lat = get<double>(in), index.max_lat = get<double>(in);
+        index.min_lon = get<double>(in), index.max_lon = get<double>(in);
+        uint32_t count = get<uint32_t>(in);
+        check_fits(in, count, sizeof(int32_t) + sizeof(uint64_t), end);
+        index.levels.resize(count);
+        for (LodIndex::Level& l : index.levels) {
+            l.zoom = get<int32_t>(in);
+            l.offset = get<uint64_t>(in);
+            if (l.offset < static_cast<uint64_t>(in.tellg()) || l.offset >= end) return false;
+        }
+        if (get<uint64_t>(in) != end) return false; // truncated or still being written
+    } catch (const std::runtime_error&) {
+        return false;
+    }
+    return true;
+}
+
+// Read level i of a LOD file into an empty data
+inline void read_lod_level(const std::string& file, const LodIndex& index, int i, OsmData& data) {
+    std::ifstream in(file, std::ios::binary);
+    if (!in) throw std::runtime_error("Failed to open LOD file " + file);
+    uint64_t end = lod_detail::file_size(in);
+    uint64_t offset = index.levels.at(i).offset;
+    if (offset >= end) throw std::runtime_error("Corrupt LOD file " + file);
+    in.seekg(static_cast<std::streamoff>(offset));
+    lod_detail::read_level(in, data, end);
+}
+
+// Read level i as above, but if it turns out corrupt behind an intact
+// index, have rebuild() write the file and index anew and read it again
+template <typename Rebuild>
+void read_lod_level(const std::string& file, const LodIndex& index, int i, OsmData& data, Rebuild&& rebuild) {
+    try {
+        read_lod_level(file, index, i, data);
+    } catch (const std::runtime_error& e) {
+        std::cerr << e.what() << ", rebuilding it\n";
+        rebuild();
+        data = OsmData();
+        read_lod_level(file, index, i, data);
+    }
+}
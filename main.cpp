@@ -5,119 +5,243 @@
 #include <vector>
 #include <limits>
 #include <cmath>
+#include <cstdio>
+#include <algorithm>
+#include <numeric>
 #include "bmp.hpp"
-
-struct Node {
-    double lat;
-    double lon;
-};
-
-std::map<std::string, Node> nodes;
-std::vector<std::vector<std::string>> ways;
+#include "lod.hpp"
+#include "osm.hpp"
+#include "png.hpp"
+#include "projection.hpp"
+#include "render.hpp"
+#include "scene.hpp"
+#include "simplify.hpp"
+#include "spatial.hpp"
+#include "style.hpp"
+
+OsmData osm;
 
 constexpr int WIDTH = 5000;
 constexpr int HEIGHT = 5000;
 
-// Draw a line using Bresenham's algorithm
-
-// Convert lat/lon to x/y using calculated scale
-void latlon_to_xy(double lat, double lon, int& x, int& y,
-                  double min_lat, double min_lon,
-                  double scale_x, double scale_y) {
-    x = static_cast<int>((lon - min_lon) * scale_x);
-    y = HEIGHT - static_cast<int>((lat - min_lat) * scale_y); // invert Y for BMP
-}
-
-void parse_osm(const std::string& filename,
-               double& min_lat, double& max_lat,
-               double& min_lon, double& max_lon) {
-    std::ifstream in(filename);
-    std::string line;
-
-    min_lat = std::numeric_limits<double>::max();
-    max_lat = std::numeric_limits<double>::lowest();
-    min_lon = std::numeric_limits<double>::max();
-    max_lon = std::numeric_limits<double>::lowest();
-
-    std::vector<std::string> current_way;
-
-    while (std::getline(in, line)) {
-        if (line.find("<node") != std::string::npos && line.find("/>") != std::string::npos) {
-            size_t id_pos = line.find("id=\"");
-            size_t lat_pos = line.find("lat=\"");
-            size_t lon_pos = line.find("lon=\"");
-
-            if (id_pos == std::string::npos || lat_pos == std::string::npos || lon_pos == std::string::npos) continue;
-
-            std::string id = line.substr(id_pos + 4, line.find("\"", id_pos + 4) - (id_pos + 4));
-            double lat = std::stod(line.substr(lat_pos + 5, line.find("\"", lat_pos + 5) - (lat_pos + 5)));
-            double lon = std::stod(line.substr(lon_pos + 5, line.find("\"", lon_pos + 5) - (lon_pos + 5)));
-
-            min_lat = std::min(min_lat, lat);
-            max_lat = std::max(max_lat, lat);
-            min_lon = std::min(min_lon, lon);
-            max_lon = std::max(max_lon, lon);
-
-            nodes[id] = {lat, lon};
-        } else if (line.find("<way") != std::string::npos) {
-            current_way.clear();
-        } else if (line.find("<nd") != std::string::npos) {
-            size_t ref_pos = line.find("ref=\"");
-            if (ref_pos != std::string::npos) {
-                std::string ref = line.substr(ref_pos + 5, line.find("\"", ref_pos + 5) - (ref_pos + 5));
-                current_way.push_back(ref);
-            }
-        } else if (line.find("</way>") != std::string::npos) {
-            if (current_way.size() >= 2) {
-                ways.push_back(current_way);
-            }
-        }
-    }
+// Pixel holding a projected point
+void to_pixel(const ScreenPoint& p, int& x, int& y) {
+    // Clamp so far-off endpoints of segments crossing a small viewport stay in int range
+    const double limit = 1 << 30;
+    x = static_cast<int>(std::floor(std::clamp(p.x, -limit, limit)));
+    y = static_cast<int>(std::floor(std::clamp(p.y, -limit, limit)));
 }
 
-
 int main(int argc, char* argv[]) {
     std::string input_file;
     std::string output_file;
 
-    if (argc != 3) {
-        std::cout << "Usage: ./main <input> <ouput> \n" ;
+    if (argc < 3) {
+        std::cout << "Usage: ./main <input> <output.bmp|output.png> [--threads N] [--bpp 24|8|1] [--mmap] [--aa] [--simplify PX] [--lod FILE]\n"
+                     "         [--projection mercator|linear] [--style FILE]\n"
+                     "         [--bbox min_lon,min_lat,max_lon,max_lat | --center lat,lon --zoom Z]\n" ;
         return -1;
     }
     
     input_file =argv[1];
     output_file = argv[2];
+    unsigned threads = 0; // one per core
+    int bpp = 24;
+    bool use_mmap = false;
+    bool antialias = false;
+    double tolerance = 0; // pixels, 0 keeps every node
+    std::string lod_file;
+    Projection projection = Projection::Mercator;
+    std::string style_file;
+    bool has_bbox = false, has_center = false;
+    BBox view{};
+    double center_lat = 0, center_lon = 0, zoom = -1;
+
+    for (int i = 3; i < argc; ++i) {
+        std::string opt = argv[i];
+        if (opt == "--threads" && i + 1 < argc) {
+            threads = std::stoul(argv[++i]);
+        } else if (opt == "--bpp" && i + 1 < argc) {
+            bpp = std::stoi(argv[++i]);
+            if (bpp != 24 && bpp != 8 && bpp != 1) {
+                std::cout << "--bpp must be 24, 8 or 1\n";
+                return -1;
+            }
+        } else if (opt == "--mmap") {
+            use_mmap = true;
+        } else if (opt == "--aa") {
+            antialias = true;
+        } else if (opt == "--simplify" && i + 1 < argc) {
+            tolerance = std::stod(argv[++i]);
+        } else if (opt == "--projection" && i + 1 < argc) {
+            projection = parse_projection(argv[++i]);
+        } else if (opt == "--style" && i + 1 < argc) {
+            style_file = argv[++i];
+        } else if (opt == "--lod" && i + 1 < argc) {
+            lod_file = argv[++i];
+        } else if (opt == "--bbox" && i + 1 < argc) {
+            view = parse_bbox(argv[++i]);
+            has_bbox = true;
+        } else if (opt == "--center" && i + 1 < argc) {
+            if (std::sscanf(argv[++i], "%lf,%lf", &center_lat, &center_lon) != 2) {
+                std::cout << "Invalid --center, expected lat,lon\n";
+                return -1;
+            }
+            has_center = true;
+        } else if (opt == "--zoom" && i + 1 < argc) {
+            zoom = std::stod(argv[++i]);
+        } else {
+            std::cout << "Unknown option: " << opt << "\n";
+            return -1;
+        }
+    }
+    if (has_center != (zoom >= 0)) {
+        std::cout << "--center and --zoom go together\n";
+        return -1;
+    }
+    if (has_center) {
+        view = bbox_around(center_lat, center_lon, zoom, WIDTH, HEIGHT);
+        has_bbox = true;
+    }
     
     std::cout << "Using input file: " << input_file << std::endl;
     std::cout << "Using output file: " << output_file << std::endl;
-    double min_lat, max_lat, min_lon, max_lon;
-
-    parse_osm(input_file, min_lat, max_lat, min_lon, max_lon);
-
-    double lon_range = max_lon - min_lon;
-    double lat_range = max_lat - min_lat;
-    if (lon_range == 0) lon_range = 1e-6;
-    if (lat_range == 0) lat_range = 1e-6;
-
-    double scale_x = WIDTH / lon_range;
-    double scale_y = HEIGHT / lat_range;
-
-    BMP bmp(WIDTH, HEIGHT);
-    color black(0, 0, 0);
-
-    for (const auto& way : ways) {
-        for (size_t i = 1; i < way.size(); ++i) {
-            if (!nodes.count(way[i - 1]) || !nodes.count(way[i])) continue;
-            const Node& n1 = nodes[way[i - 1]];
-            const Node& n2 = nodes[way[i]];
-            int x1, y1, x2, y2;
-            latlon_to_xy(n1.lat, n1.lon, x1, y1, min_lat, min_lon, scale_x, scale_y);
-            latlon_to_xy(n2.lat, n2.lon, x2, y2, min_lat, min_lon, scale_x, scale_y);
-            draw_line(bmp, x1, y1, x2, y2, black);
+    ThreadPool pool(threads);
+
+    // A current LOD file stands in for the input until the view is known;
+    // otherwise the input is parsed and the LOD file rebuilt from it
+    LodIndex lod;
+    bool have_lod = false, loaded = false;
+    auto load = [&] {
+        load_osm(input_file.c_str(), TagFilter(), LoadMode::AllNodes, osm);
+        loaded = true;
+    };
+    LodSource source = lod_file.empty() ? LodSource{} : lod_source(input_file, "");
+    auto build_lod = [&] {
+        if (!loaded) load();
+        write_lod(lod_file, source, osm, LOD_ZOOMS, pool);
+        have_lod = read_lod_index(lod_file, source, lod);
+        std::cout << "Wrote " << lod_file << std::endl;
+    };
+    if (!lod_file.empty()) {
+        have_lod = read_lod_index(lod_file, source, lod);
+        if (!have_lod) build_lod();
+    } else {
+        load();
+    }
+    BBox bounds = has_bbox ? view
+                  : have_lod ? BBox{lod.min_lon, lod.min_lat, lod.max_lon, lod.max_lat}
+                             : BBox{osm.min_lon, osm.min_lat, osm.max_lon, osm.max_lat};
+    View frame = View::fit(projection, bounds, WIDTH, HEIGHT);
+
+    if (have_lod) {
+        int level = lod.level_for(frame.zoom);
+        if (level >= 0) {
+            OsmData data;
+            read_lod_level(lod_file, lod, level, data, build_lod);
+            osm = std::move(data);
+            std::cout << "Using level of detail for zoom " << lod.levels[level].zoom << ": " << osm.ways.size()
+                      << " ways" << std::endl;
+        } else if (!loaded) {
+            load();
         }
     }
 
-    bmp.write(output_file);
+    std::vector<Segment> segments;
+    Areas areas;
+
+    // Color, width and layer of every way, decided once from its tags
+    StyleSheet sheet = style_file.empty() ? StyleSheet::defaults() : StyleSheet::load(style_file);
+    WayStyles styles = style_ways(osm, sheet, pool);
+
+    // Every node projected once, then nodes the picture cannot show are
+    // dropped before making segments
+    std::vector<ScreenPoint> px = project_nodes(osm.nodes, frame, pool);
+    SimplifiedWays simple = simplify_ways(osm, px, tolerance, pool);
+
+    // Segment from way_nodes position i to j of way w
+    auto add_segment = [&](uint32_t w, uint32_t i, uint32_t j) {
+        uint32_t a = osm.way_nodes[i], b = osm.way_nodes[j];
+        if (a == NO_NODE || b == NO_NODE) return;
+        int x1, y1, x2, y2;
+        to_pixel(px[a], x1, y1);
+        to_pixel(px[b], x2, y2);
+        const Style& style = styles.of(w);
+        segments.push_back({x1, y1, x2, y2, style.stroke, style.width});
+    };
+
+    // Segments joining the kept positions first..last of way w; both ends are kept
+    auto add_run = [&](uint32_t w, uint32_t first, uint32_t last) {
+        if (!styles.stroked(w)) return;
+        for (uint32_t k = first + 1; k <= last; ++k) {
+            if (!simple.kept(k)) continue;
+            add_segment(w, first, k);
+            first = k;
+        }
+    };
+
+    // A filled area: the kept nodes of a closed way, or the rings of a
+    // multipolygon
+    auto add_area = [&](const WayStyles::Area& a) {
+        for_each_ring_node(
+            osm, a, &simple, [&](uint32_t n) { areas.add_point(px[n].x, px[n].y); }, [&] { areas.end_ring(); });
+        areas.end_area(styles.of_area(a).fill);
+    };
+
+    if (has_bbox) {
+        // Only segments crossing the viewport, in file order within a layer
+        // so overdraw is the same as for the whole map
+        SegmentIndex index(osm);
+        std::vector<uint32_t> visible;
+        index.query(view, [&](uint32_t k) { visible.push_back(k); });
+        std::sort(visible.begin(), visible.end());
+        for (const Run& run : visible_runs(osm, styles, visible, &simple)) add_run(run.way, run.first, run.last);
+        // Areas are filled whole, once each, under all the lines
+        for (const WayStyles::Area& a : areas_in_view(osm, styles, ClosedWayIndex(osm), MultipolygonIndex(osm), view))
+            add_area(a);
+        std::cout << visible.size() << " of " << index.size() << " segments in view" << std::endl;
+    } else {
+        // Layers bottom up
+        for (uint32_t w : styles.order)
+            if (osm.ways[w].node_count > 1)
+                add_run(w, osm.ways[w].node_begin, osm.ways[w].node_begin + osm.ways[w].node_count - 1);
+        std::vector<uint32_t> area_relations(osm.multipolygons.size());
+        std::iota(area_relations.begin(), area_relations.end(), 0);
+        for (const WayStyles::Area& a : styles.areas(osm, styles.order, area_relations)) add_area(a);
+    }
+    if (areas.size() > 0) std::cout << areas.size() << " areas filled" << std::endl;
+    if (tolerance > 0) std::cout << segments.size() << " segments after simplification" << std::endl;
+
+    // Indexed canvases: white background, then the style colors if they
+    // fit, else black
+    std::vector<color> palette{color(255, 255, 255)};
+    auto add_color = [&](const color& c) {
+        bool seen = false;
+        for (const color& p : palette) seen |= p.r == c.r && p.g == c.g && p.b == c.b;
+        if (!seen && palette.size() < 256) palette.push_back(c);
+    };
+    if (bpp == 8) {
+        for (const Style& s : styles.styles) {
+            if (s.stroked) add_color(s.stroke);
+            if (s.filled) add_color(s.fill);
+        }
+    }
+    if (palette.size() == 1) palette.push_back(color(0, 0, 0));
+    bool to_png = output_file.size() > 4 && output_file.compare(output_file.size() - 4, 4, ".png") == 0;
+    if (to_png) {
+        BMP bmp(WIDTH, HEIGHT, bpp, palette);
+        render_segments(bmp, areas, segments, pool, antialias);
+        png::Options opt;
+        opt.pool = &pool;
+        png::write(bmp, output_file, opt);
+    } else if (use_mmap) {
+        // Draw straight into the mapped output file
+        BMP bmp = BMP::map_file(output_file, WIDTH, HEIGHT, bpp, palette);
+        render_segments(bmp, areas, segments, pool, antialias);
+    } else {
+        // BMP rows go out band by band; the full canvas is never allocated
+        render_segments_to_file(output_file, WIDTH, HEIGHT, areas, segments, pool, bpp, palette, antialias);
+    }
     std::cout << "Map saved to " << output_file << std::endl;
     return 0;
 }
@@ -0,0 +1,115 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+// Fixed-format parsers for the numbers in OSM XML attributes: ids and
+// coordinates with at most 7 decimals. They work on [p, end) ranges,
+// never allocate and ignore the locale. Digits are handled eight at a
+// time with SWAR arithmetic instead of a per-character loop.
+namespace numparse {
+
+// Up to 8 bytes from [p, end), zero padded (zero is never a digit)
+inline uint64_t load8(const char* p, const char* end) {
+    uint64_t v = 0;
+    if (end - p >= 8) std::memcpy(&v, p, 8);
+    else if (end > p) std::memcpy(&v, p, end - p);
+    return v;
+}
+
+// Number of leading ASCII digits in chunk (first byte is the lowest)
+inline int digit_count(uint64_t chunk) {
+    const uint64_t hi = 0xF0F0F0F0F0F0F0F0ull;
+    const uint64_t threes = 0x3030303030303030ull;
+    uint64_t not_digit = ((chunk & hi) ^ threes) | (((chunk + 0x0606060606060606ull) & hi) ^ threes);
+    return not_digit ? __builtin_ctzll(not_digit) >> 3 : 8;
+}
+
+// Value of the first n (0..8) digits of chunk
+inline uint64_t digits_value(uint64_t chunk, int n) {
+    // Move the digits to the top bytes and fill the bottom with '0'
+    unsigned s = 8 * (8 - n);
+    uint64_t fill = 0x3030303030303030ull;
+    chunk = ((chunk << (s / 2)) << (s - s / 2)) | (s ? fill >> (64 - s) : 0);
+    uint64_t v = chunk - fill;
+    v = (v * 10) + (v >> 8);
+    v = (((v & 0x000000FF000000FFull) * 0x000F424000000064ull) +
+         (((v >> 16) & 0x000000FF000000FFull) * 0x0000271000000001ull)) >> 32;
+    return v;
+}
+
+inline constexpr uint64_t POW10[9] = {1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000};
+
+// Parses [-]digits. Returns the end of the number, or nullptr if there
+// are no digits or more than 18.
+inline const char* parse_id(const char* p, const char* end, long long& out) {
+    bool neg = p < end && *p == '-';
+    p += neg;
+    uint64_t chunk = load8(p, end);
+    int n = digit_count(chunk);
+    if (n == 0) return nullptr;
+    uint64_t v = digits_value(chunk, n);
+    int total = n;
+    while (n == 8 && total <= 18) {
+        chunk = load8(p + total, end);
+        n = digit_count(chunk);
+        v = v * POW10[n] + digits_value(chunk, n);
+        total += n;
+    }
+    if (total > 18) return nullptr;
+    p += total;
+    long long s = static_cast<long long>(v);
+    out = neg ? -s : s;
+    return p;
+}
+
+// Parses [-]ddd[.fffffff] as fixed point in units of 1e-7 (the OSM
+// coordinate precision). Decimals past the seventh are truncated.
+inline const char* parse_fixed7(const char* p, const char* end, int32_t& out) {
+    bool neg = p < end && *p == '-';
+    p += neg;
+    uint64_t chunk = load8(p, end);
+    int n = digit_count(chunk);
+    if (n == 0 || n > 3) return nullptr;
+    int64_t v = static_cast<int64_t>(digits_value(chunk, n)) * 10000000;
+    p += n;
+    if (p < end && *p == '.') {
+        ++p;
+        chunk = load8(p, end);
+        int f = digit_count(chunk);
+        int used = f < 7 ? f : 7;
+        v += static_cast<int64_t>(digits_value(chunk, used)) * static_cast<int64_t>(POW10[7 - used]);
+        p += f;
+        while (p < end && *p >= '0' && *p <= '9') ++p;
+    }
+    if (v > INT32_MAX) return nullptr;
+    out = static_cast<int32_t>(neg ? -v : v);
+    return p;
+}
+
+// Degrees from a 1e-7 fixed point value. Division (not * 1e-7) gives the
+// same double std::stod returns for the decimal text.
+inline double fixed7_to_deg(int32_t v) {
+    return v / 1e7;
+}
+
+// Whole-string variants for attribute values, throwing like std::stoll
+inline long long parse_id(std::string_view s) {
+    long long v;
+    const char* e = s.data() + s.size();
+    if (s.empty() || parse_id(s.data(), e, v) != e)
+        throw std::runtime_error("Invalid OSM id: " + std::string(s));
+    return v;
+}
+
+inline double parse_deg(std::string_view s) {
+    int32_t v;
+    const char* e = s.data() + s.size();
+    if (s.empty() || parse_fixed7(s.data(), e, v) != e)
+        throw std::runtime_error("Invalid coordinate: " + std::string(s));
+    return fixed7_to_deg(v);
+}
+
+} // namespace numparse
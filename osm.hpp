@@ -0,0 +1,409 @@
+#pragma once
+#include <algorithm>
+#include <iterator>
+#include <limits>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "tags.hpp"
+#include "filter.hpp"
+#include "idset.hpp"
+#include "numparse.hpp"
+#include "osm_reader.hpp"
+
+struct Node {
+    double lat, lon;
+};
+
+// Node index stored for refs to nodes that are not in the file
+constexpr uint32_t NO_NODE = 0xffffffff;
+
+struct Way {
+    long long id;
+    uint32_t node_begin; // slice of OsmData::way_nodes
+    uint32_t node_count;
+    TagRange tags;
+};
+
+// Closed ring of a multipolygon: a slice of OsmData::ring_nodes whose last
+// node repeats the first
+struct Ring {
+    uint32_t node_begin;
+    uint32_t node_count;
+    bool inner;
+};
+
+// Multipolygon (or boundary) relation with its member ways stitched into rings
+struct Multipolygon {
+    long long id;
+    uint32_t ring_begin; // slice of OsmData::rings
+    uint32_t ring_count;
+    TagRange tags;
+};
+
+enum class LoadMode {
+    AllNodes,        // one pass, every node in the file is kept
+    ReferencedNodes, // pass 1 collects refs of kept ways, pass 2 keeps only those nodes
+};
+
+struct OsmData {
+    TagStore tags;
+    std::vector<long long> node_ids; // sorted ascending
+    std::vector<Node> nodes;         // nodes[i] has id node_ids[i]
+    std::unordered_map<long long, TagRange> node_tags; // only nodes that have tags
+    std::vector<Way> ways;
+    std::vector<uint32_t> way_nodes; // node indexes of all ways, back to back
+    std::vector<Multipolygon> multipolygons;
+    std::vector<Ring> rings;
+    std::vector<uint32_t> ring_nodes; // node indexes of all rings, back to back
+
+    double min_lat = 1e9, max_lat = -1e9;
+    double min_lon = 1e9, max_lon = -1e9;
+
+    // Index into nodes, or NO_NODE
+    uint32_t find_node(long long id) const {
+        auto it = std::lower_bound(node_ids.begin(), node_ids.end(), id);
+        if (it == node_ids.end() || *it != id) return NO_NODE;
+        return static_cast<uint32_t>(it - node_ids.begin());
+    }
+
+    // Index of the way whose slice of way_nodes contains position k
+    uint32_t way_at(uint32_t k) const {
+        auto it = std::upper_bound(ways.begin(), ways.end(), k,
+                                   [](uint32_t v, const Way& w) { return v < w.node_begin; });
+        return static_cast<uint32_t>(it - ways.begin()) - 1;
+    }
+
+    // Whether w ends on the node it starts with, enclosing an area
+    bool closed(const Way& w) const {
+        return w.node_count >= 4 && way_nodes[w.node_begin] != NO_NODE &&
+               way_nodes[w.node_begin] == way_nodes[w.node_begin + w.node_count - 1];
+    }
+
+    const uint32_t* way_begin(const Way& w) const { return way_nodes.data() + w.node_begin; }
+    const uint32_t* way_end(const Way& w) const { return way_nodes.data() + w.node_begin + w.node_count; }
+};
+
+namespace osm_detail {
+
+// Reads the current <node> element, including its <tag> children
+inline void read_node(OsmReader& r, long long id, OsmData& data) {
+    double lat = numparse::parse_deg(r.attr("lat"));
+    double lon = numparse::parse_deg(r.attr("lon"));
+    data.node_ids.push_back(id);
+    data.nodes.push_back({lat, lon});
+
+    uint32_t begin = data.tags.open();
+    if (!r.self_closing()) {
+        while (r.next() && !r.at_end_of("node"))
+            if (r.name() == "tag") data.tags.add(r.attr("k"), r.attr("v"));
+    }
+    TagRange tr = data.tags.close(begin);
+    if (tr.count) data.node_tags[id] = tr;
+}
+
+// Skip the children of the current element
+inline void skip_element(OsmReader& r, std::string_view name) {
+    if (r.self_closing()) return;
+    while (r.next() && !r.at_end_of(name)) {}
+}
+
+// Reads the current <way> element and appends its node ids to refs if it
+// passes the filter. The filter is checked on a first look at the tags
+// using dictionary lookups only, so rejected ways allocate nothing.
+inline bool read_way(OsmReader& r, const TagFilter& filter, OsmData& data,
+                     std::vector<long long>& refs, std::vector<Tag>& scratch) {
+    Way way;
+    way.id = numparse::parse_id(r.attr("id"));
+    way.node_begin = static_cast<uint32_t>(refs.size());
+    way.node_count = 0;
+    way.tags = data.tags.close(data.tags.open());
+    if (r.self_closing()) {
+        if (!filter.match(nullptr, nullptr)) return false;
+        data.ways.push_back(way);
+        return true;
+    }
+
+    if (!filter.empty()) {
+        const char* children = r.mark();
+        scratch.clear();
+        while (r.next() && !r.at_end_of("way")) {
+            if (r.name() == "tag")
+                scratch.push_back({data.tags.dict.find(r.attr("k")), data.tags.dict.find(r.attr("v"))});
+        }
+        if (!filter.match(scratch.data(), scratch.data() + scratch.size())) return false;
+        r.reset(children);
+    }
+
+    uint32_t begin = data.tags.open();
+    while (r.next() && !r.at_end_of("way")) {
+        if (r.name() == "nd")
+            refs.push_back(numparse::parse_id(r.attr("ref")));
+        else if (r.name() == "tag")
+            data.tags.add(r.attr("k"), r.attr("v"));
+    }
+    way.node_count = static_cast<uint32_t>(refs.size()) - way.node_begin;
+    way.tags = data.tags.close(begin);
+    data.ways.push_back(way);
+    return true;
+}
+
+// Relations read but not yet assembled: the member ways of relation i
+// are members[member_begin[i], member_begin[i + 1])
+struct Relations {
+    struct Member {
+        long long way;
+        bool inner;
+    };
+    std::vector<long long> ids;
+    std::vector<TagRange> tags;
+    std::vector<uint32_t> member_begin{0};
+    std::vector<Member> members;
+};
+
+// Reads the current <relation> element into rel if it is a multipolygon
+// or boundary and passes the filter. Only way members are kept.
+inline bool read_relation(OsmReader& r, const TagFilter& filter, OsmData& data, Relations& rel) {
+    if (r.self_closing()) return false;
+    long long id = numparse::parse_id(r.attr("id"));
+    size_t first_member = rel.members.size();
+    uint32_t begin = data.tags.open();
+    bool area = false;
+    while (r.next() && !r.at_end_of("relation")) {
+        if (r.name() == "member") {
+            if (r.attr("type") == "way")
+                rel.members.push_back({numparse::parse_id(r.attr("ref")), r.attr("role") == "inner"});
+        } else if (r.name() == "tag") {
+            std::string_view k = r.attr("k"), v = r.attr("v");
+            area |= k == "type" && (v == "multipolygon" || v == "boundary");
+            data.tags.add(k, v);
+        }
+    }
+    TagRange tr = data.tags.close(begin);
+    if (!area || rel.members.size() == first_member || !filter.match(data.tags, tr)) {
+        data.tags.rollback(begin);
+        rel.members.resize(first_member);
+        return false;
+    }
+    rel.ids.push_back(id);
+    rel.tags.push_back(tr);
+    rel.member_begin.push_back(static_cast<uint32_t>(rel.members.size()));
+    return true;
+}
+
+// Node ids of the ways relations use, by way id. Ways that were loaded
+// point into refs; members the filter dropped are read again into extra.
+struct MemberWays {
+    struct Slice {
+        const std::vector<long long>* refs;
+        uint32_t begin, count;
+    };
+    std::unordered_map<long long, Slice> ways;
+    std::vector<long long> extra;
+};
+
+inline void find_member_ways(OsmReader& r, const OsmData& data, const std::vector<long long>& refs,
+                             const Relations& rel, MemberWays& out) {
+    for (const Relations::Member& m : rel.members) out.ways.emplace(m.way, MemberWays::Slice{nullptr, 0, 0});
+    size_t missing = out.ways.size();
+    for (const Way& w : data.ways) {
+        auto it = out.ways.find(w.id);
+        if (it == out.ways.end() || it->second.refs) continue;
+        it->second = {&refs, w.node_begin, w.node_count};
+        --missing;
+    }
+    if (missing == 0) return;
+
+    // Another pass for members the filter rejected, keeping only their refs
+    r.rewind();
+    while (r.next()) {
+        if (r.is_end() || r.name() != "way") continue;
+        auto it = out.ways.find(numparse::parse_id(r.attr("id")));
+        if (it == out.ways.end() || it->second.refs || r.self_closing()) continue;
+        uint32_t begin = static_cast<uint32_t>(out.extra.size());
+        while (r.next() && !r.at_end_of("way"))
+            if (r.name() == "nd") out.extra.push_back(numparse::parse_id(r.attr("ref")));
+        it->second = {&out.extra, begin, static_cast<uint32_t>(out.extra.size()) - begin};
+    }
+}
+
+// Stitch the member ways of every relation into closed rings, with node
+// ids going to ring_refs. Closed members are rings by themselves; open
+// ones are joined end to end, found through a hash of their end nodes,
+// until the ring closes. Rings that cannot be closed are dropped, and so
+// are relations left with no ring.
+inline void assemble_multipolygons(OsmData& data, const Relations& rel, const MemberWays& member_ways,
+                                   std::vector<long long>& ring_refs) {
+    struct Chain {
+        const long long* nodes;
+        uint32_t count;
+        bool inner;
+        bool used;
+    };
+    // Chain ends by node id, in a list per node: end e is chain e / 2, at
+    // its front if e is even, and next[e] is the following end on the node
+    std::vector<Chain> chains;
+    std::unordered_map<long long, uint32_t> first_end;
+    std::vector<uint32_t> next;
+    constexpr uint32_t NONE = 0xffffffff;
+
+    for (size_t i = 0; i < rel.ids.size(); ++i) {
+        chains.clear();
+        for (uint32_t m = rel.member_begin[i]; m < rel.member_begin[i + 1]; ++m) {
+            auto it = member_ways.ways.find(rel.members[m].way);
+            if (it == member_ways.ways.end() || it->second.count < 2) continue;
+            const MemberWays::Slice& w = it->second;
+            chains.push_back({w.refs->data() + w.begin, w.count, rel.members[m].inner, false});
+        }
+
+        Multipolygon mp{rel.ids[i], static_cast<uint32_t>(data.rings.size()), 0, rel.tags[i]};
+
+        first_end.clear();
+        next.assign(2 * chains.size(), NONE);
+        for (uint32_t c = 0; c < chains.size(); ++c) {
+            const Chain& ch = chains[c];
+            if (ch.nodes[0] == ch.nodes[ch.count - 1]) continue;
+            for (uint32_t e : {2 * c, 2 * c + 1}) {
+                long long node = e & 1 ? ch.nodes[ch.count - 1] : ch.nodes[0];
+                auto [it, fresh] = first_end.try_emplace(node, e);
+                if (!fresh) next[e] = std::exchange(it->second, e);
+            }
+        }
+
+        for (uint32_t c = 0; c < chains.size(); ++c) {
+            if (chains[c].used) continue;
+            chains[c].used = true;
+            size_t begin = ring_refs.size();
+            ring_refs.insert(ring_refs.end(), chains[c].nodes, chains[c].nodes + chains[c].count);
+            // Follow unused chains from the open end until back at the start
+            while (ring_refs.back() != ring_refs[begin]) {
+                auto it = first_end.find(ring_refs.back());
+                uint32_t e = it == first_end.end() ? NONE : it->second;
+                while (e != NONE && chains[e / 2].used) e = next[e];
+                if (e == NONE) break;
+                Chain& ch = chains[e / 2];
+                ch.used = true;
+                if (e & 1)
+                    ring_refs.insert(ring_refs.end(), std::make_reverse_iterator(ch.nodes + ch.count - 1),
+                                     std::make_reverse_iterator(ch.nodes));
+                else
+                    ring_refs.insert(ring_refs.end(), ch.nodes + 1, ch.nodes + ch.count);
+            }
+            if (ring_refs.back() != ring_refs[begin] || ring_refs.size() - begin < 4) {
+                ring_refs.resize(begin);
+                continue;
+            }
+            data.rings.push_back({static_cast<uint32_t>(begin), static_cast<uint32_t>(ring_refs.size() - begin),
+                                  chains[c].inner});
+        }
+        mp.ring_count = static_cast<uint32_t>(data.rings.size()) - mp.ring_begin;
+        if (mp.ring_count) data.multipolygons.push_back(mp);
+    }
+}
+
+// Sort nodes by id, turn way and ring refs into node indexes and compute bounds
+inline void finish(OsmData& data, const std::vector<long long>& refs, const std::vector<long long>& ring_refs) {
+    if (!std::is_sorted(data.node_ids.begin(), data.node_ids.end())) {
+        std::vector<uint32_t> order(data.node_ids.size());
+        std::iota(order.begin(), order.end(), 0);
+        std::stable_sort(order.begin(), order.end(),
+                         [&](uint32_t a, uint32_t b) { return data.node_ids[a] < data.node_ids[b]; });
+        std::vector<long long> ids(order.size());
+        std::vector<Node> nodes(order.size());
+        for (size_t i = 0; i < order.size(); ++i) {
+            ids[i] = data.node_ids[order[i]];
+            nodes[i] = data.nodes[order[i]];
+        }
+        data.node_ids.swap(ids);
+        data.nodes.swap(nodes);
+    }
+
+    data.way_nodes.resize(refs.size());
+    for (size_t i = 0; i < refs.size(); ++i)
+        data.way_nodes[i] = data.find_node(refs[i]);
+    data.ring_nodes.resize(ring_refs.size());
+    for (size_t i = 0; i < ring_refs.size(); ++i)
+        data.ring_nodes[i] = data.find_node(ring_refs[i]);
+
+    for (const Node& n : data.nodes) {
+        data.min_lat = std::min(data.min_lat, n.lat);
+        data.max_lat = std::max(data.max_lat, n.lat);
+        data.min_lon = std::min(data.min_lon, n.lon);
+        data.max_lon = std::max(data.max_lon, n.lon);
+    }
+}
+
+} // namespace osm_detail
+
+// Load nodes and the ways matching filter from an OSM XML file, and with
+// areas set the multipolygon and boundary relations matching it,
+// assembled into rings
+inline void load_osm(const char* filename, const TagFilter& filter, LoadMode mode, OsmData& data,
+                     bool areas = true) {
+    OsmReader r(filename);
+    std::vector<long long> refs;
+    std::vector<Tag> scratch;
+    osm_detail::Relations relations;
+
+    if (mode == LoadMode::AllNodes) {
+        while (r.next()) {
+            if (r.is_end()) continue;
+            if (r.name() == "node")
+                osm_detail::read_node(r, numparse::parse_id(r.attr("id")), data);
+            else if (r.name() == "way")
+                osm_detail::read_way(r, filter, data, refs, scratch);
+            else if (r.name() == "relation" && areas)
+                osm_detail::read_relation(r, filter, data, relations);
+        }
+    } else {
+        while (r.next()) {
+            if (r.is_end()) continue;
+            if (r.name() == "way")
+                osm_detail::read_way(r, filter, data, refs, scratch);
+            else if (r.name() == "relation" && areas)
+                osm_detail::read_relation(r, filter, data, relations);
+            else if (r.name() == "node" || r.name() == "relation")
+                osm_detail::skip_element(r, r.name());
+        }
+    }
+
+    std::vector<long long> ring_refs;
+    if (!relations.ids.empty()) {
+        osm_detail::MemberWays members;
+        osm_detail::find_member_ways(r, data, refs, relations, members);
+        osm_detail::assemble_multipolygons(data, relations, members, ring_refs);
+    }
+
+    if (mode == LoadMode::ReferencedNodes) {
+        long long lo = 0, hi = -1;
+        if (!refs.empty() || !ring_refs.empty()) {
+            lo = std::numeric_limits<long long>::max(), hi = std::numeric_limits<long long>::min();
+            for (const std::vector<long long>* v : {&refs, &ring_refs}) {
+                if (v->empty()) continue;
+                auto [min, max] = std::minmax_element(v->begin(), v->end());
+                lo = std::min(lo, *min), hi = std::max(hi, *max);
+            }
+        }
+        IdBitset wanted(lo, hi);
+        for (long long ref : refs) wanted.insert(ref);
+        for (long long ref : ring_refs) wanted.insert(ref);
+
+        data.node_ids.reserve(wanted.size());
+        data.nodes.reserve(wanted.size());
+        r.rewind();
+        while (r.next()) {
+            if (r.is_end() || r.name() != "node") continue;
+            long long id = numparse::parse_id(r.attr("id"));
+            if (wanted.contains(id))
+                osm_detail::read_node(r, id, data);
+            else
+                osm_detail::skip_element(r, "node");
+        }
+    }
+
+    osm_detail::finish(data, refs, ring_refs);
+}
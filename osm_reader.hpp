@@ -0,0 +1,259 @@
+#pragma once
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "scan.hpp"
+
+struct XmlAttr {
+    std::string_view name;
+    std::string_view value;
+};
+
+// Pull parser for OSM XML. The file is memory mapped and tokenized in
+// place: scan.hpp indexes the structural characters of a window of the
+// file at a time and next() walks that index. Names and attribute values
+// are views into the mapping; values with entities are decoded into a
+// side buffer that lives until the next call to next().
+//
+// Attribute values may be quoted with " or ', as JOSM writes them; a
+// quote inside a comment would confuse the quote tracking.
+class OsmReader {
+public:
+    explicit OsmReader(const char* filename) : index(WINDOW) {
+        fd = ::open(filename, O_RDONLY);
+        if (fd < 0) throw std::runtime_error("Failed to read OSM file");
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            ::close(fd);
+            throw std::runtime_error("Failed to read OSM file");
+        }
+        size = static_cast<size_t>(st.st_size);
+        if (size) {
+            void* m = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (m == MAP_FAILED) {
+                ::close(fd);
+                throw std::runtime_error("Failed to map OSM file");
+            }
+            madvise(m, size, MADV_SEQUENTIAL);
+            base = static_cast<const char*>(m);
+        }
+        end = base + size;
+        reset(base);
+    }
+
+    ~OsmReader() {
+        if (base) munmap(const_cast<char*>(base), size);
+        if (fd >= 0) ::close(fd);
+    }
+
+    OsmReader(const OsmReader&) = delete;
+    OsmReader& operator=(const OsmReader&) = delete;
+
+    // Advance to the next start or end tag. Returns false at end of file.
+    bool next() {
+        attrs_.clear();
+        decoded_count = 0;
+        for (;;) {
+            const char* lt;
+            do {
+                lt = next_structural();
+                if (lt == end) return false;
+            } while (*lt != '<');
+
+            const char* p = lt + 1;
+            if (p < end && (*p == '?' || *p == '!')) {
+                skip_special(p);
+                continue;
+            }
+            closing = p < end && *p == '/';
+            p += closing;
+            const char* name_end = p;
+            while (name_end < end && !scan::is_space(*name_end) && *name_end != '/' &&
+                   *name_end != '>' && *name_end != '=')
+                ++name_end;
+            name_ = std::string_view(p, name_end - p);
+            parse_rest(name_end);
+            return true;
+        }
+    }
+
+    std::string_view name() const { return name_; }
+    bool is_end() const { return closing; }
+    bool self_closing() const { return self_closing_; }
+    const std::vector<XmlAttr>& attrs() const { return attrs_; }
+
+    std::string_view attr(std::string_view name) const {
+        for (const XmlAttr& a : attrs_)
+            if (a.name == name) return a.value;
+        return {};
+    }
+
+    // True once the element opened by the current tag has been closed:
+    // right away for <x/>, otherwise when </name> is reached
+    bool at_end_of(std::string_view element) const {
+        return (closing || self_closing_) && name_ == element;
+    }
+
+    // Position to come back to with reset(), e.g. to read children twice
+    const char* mark() const { return tag_end; }
+
+    void reset(const char* m) {
+        attrs_.clear();
+        tag_end = m;
+        // Usually the mark is still in the indexed window
+        if (m >= window && m <= window_end && idx_count) {
+            uint32_t off = static_cast<uint32_t>(m - window);
+            idx_pos = std::lower_bound(index.begin(), index.begin() + idx_count, off) - index.begin();
+            return;
+        }
+        // Marks always sit right after a '>', outside any quotes
+        scan_pos = m;
+        window = window_end = m;
+        idx_pos = idx_count = 0;
+        in_string = 0;
+    }
+
+    void rewind() {
+        idx_count = 0;
+        reset(base);
+    }
+
+private:
+    static constexpr size_t WINDOW = 256 * 1024;
+
+    int fd{-1};
+    const char* base{nullptr};
+    size_t size{0};
+    const char* end{nullptr};
+
+    // Structural index of [window, window_end)
+    std::vector<uint32_t> index;
+    const char* window{nullptr};
+    const char* window_end{nullptr};
+    size_t idx_pos{0};
+    size_t idx_count{0};
+    const char* scan_pos{nullptr};
+    uint64_t in_string{0};
+
+    std::string_view name_;
+    bool closing{false};
+    bool self_closing_{false};
+    const char* tag_end{nullptr};
+    std::vector<XmlAttr> attrs_;
+    std::deque<std::string> decoded;
+    size_t decoded_count{0};
+
+    // Next < > = or value quote in the file, or end
+    const char* next_structural() {
+        while (idx_pos == idx_count) {
+            if (scan_pos >= end) return end;
+            size_t n = std::min(WINDOW, static_cast<size_t>(end - scan_pos));
+            window = scan_pos;
+            window_end = scan_pos + n;
+            idx_count = scan::index_structurals(scan_pos, n, in_string, index.data());
+            idx_pos = 0;
+            scan_pos += n;
+        }
+        return window + index[idx_pos++];
+    }
+
+    // Attributes up to the closing '>'
+    void parse_rest(const char* cursor) {
+        self_closing_ = false;
+        for (;;) {
+            const char* s = next_structural();
+            if (s == end) {
+                tag_end = end;
+                return;
+            }
+            if (*s == '>') {
+                self_closing_ = !closing && s[-1] == '/';
+                tag_end = s + 1;
+                return;
+            }
+            if (*s != '=') continue; // stray quote, malformed
+            const char* a = cursor;
+            while (a < s && scan::is_space(*a)) ++a;
+            const char* b = s;
+            while (b > a && scan::is_space(b[-1])) --b;
+            const char* q1 = next_structural();
+            if (q1 == end || (*q1 != '"' && *q1 != '\'')) continue;
+            const char* q2 = next_structural();
+            std::string_view value(q1 + 1, q2 - q1 - 1);
+            if (std::memchr(value.data(), '&', value.size())) value = decode(value);
+            attrs_.push_back({std::string_view(a, b - a), value});
+            cursor = q2 < end ? q2 + 1 : end;
+        }
+    }
+
+    // Skip <?...?>, <!-- ... --> and <!DOCTYPE ...>
+    void skip_special(const char* p) {
+        bool comment = end - p >= 3 && p[0] == '!' && p[1] == '-' && p[2] == '-';
+        for (;;) {
+            const char* s = next_structural();
+            if (s == end) return;
+            if (*s == '>' && (!comment || (s - p >= 4 && s[-1] == '-' && s[-2] == '-'))) return;
+        }
+    }
+
+    // Replace XML entities; the result lives in a reused side buffer
+    std::string_view decode(std::string_view in) {
+        // deque: growing never moves the strings earlier views point into
+        if (decoded_count == decoded.size()) decoded.emplace_back();
+        std::string& out = decoded[decoded_count++];
+        out.clear();
+        for (size_t i = 0; i < in.size(); ++i) {
+            if (in[i] != '&') {
+                out += in[i];
+                continue;
+            }
+            size_t semi = in.find(';', i);
+            if (semi == std::string_view::npos) {
+                out += in.substr(i);
+                break;
+            }
+            std::string_view ent = in.substr(i + 1, semi - i - 1);
+            if (ent == "amp") out += '&';
+            else if (ent == "lt") out += '<';
+            else if (ent == "gt") out += '>';
+            else if (ent == "quot") out += '"';
+            else if (ent == "apos") out += '\'';
+            else if (ent.size() > 1 && ent[0] == '#') {
+                bool hex = ent[1] == 'x' || ent[1] == 'X';
+                unsigned long cp = std::strtoul(std::string(ent.substr(hex ? 2 : 1)).c_str(), nullptr, hex ? 16 : 10);
+                append_utf8(out, cp);
+            } else {
+                out += in.substr(i, semi - i + 1);
+            }
+            i = semi;
+        }
+        return out;
+    }
+
+    static void append_utf8(std::string& out, unsigned long cp) {
+        if (cp < 0x80) {
+            out += static_cast<char>(cp);
+        } else if (cp < 0x800) {
+            out += static_cast<char>(0xC0 | (cp >> 6));
+            out += static_cast<char>(0x80 | (cp & 0x3F));
+        } else if (cp < 0x10000) {
+            out += static_cast<char>(0xE0 | (cp >> 12));
+            out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+            out += static_cast<char>(0x80 | (cp & 0x3F));
+        } else {
+            out += static_cast<char>(0xF0 | (cp >> 18));
+            out += static_cast<char>(0x80 | ((cp >> 12) & 0x3F));
+            out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+            out += static_cast<char>(0x80 | (cp & 0x3F));
+        }
+    }
+};
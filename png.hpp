@@ -0,0 +1,410 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "bmp.hpp"
+#include "threadpool.hpp"
+
+// PNG writer with its own deflate, so no zlib is needed. Compression is
+// static Huffman only: quick to produce and, on line maps that are mostly
+// one background color, within a few percent of what zlib gets.
+namespace png {
+
+enum class Deflate {
+    Rle,  // only runs of the previous byte (distance 1)
+    Fast, // runs plus one hash probe per position for longer repeats
+};
+
+struct Options {
+    Deflate mode = Deflate::Fast;
+    bool palette = true;         // indexed color when the image has <= 256 colors
+    ThreadPool* pool = nullptr;  // compress stripes on the pool when set
+    int stripe_rows = 128;       // rows per independently compressed stripe
+};
+
+namespace detail {
+
+inline const uint32_t* crc_table() {
+    static const std::array<uint32_t, 256> table = [] {
+        std::array<uint32_t, 256> t{};
+        for (uint32_t n = 0; n < 256; ++n) {
+            uint32_t c = n;
+            for (int k = 0; k < 8; ++k) c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            t[n] = c;
+        }
+        return t;
+    }();
+    return table.data();
+}
+
+inline uint32_t crc32(uint32_t crc, const uint8_t* p, size_t n) {
+    const uint32_t* t = crc_table();
+    crc = ~crc;
+    for (size_t i = 0; i < n; ++i) crc = t[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+constexpr uint32_t ADLER_MOD = 65521;
+
+inline uint32_t adler32(uint32_t adler, const uint8_t* p, size_t n) {
+    uint32_t a = adler & 0xffff, b = adler >> 16;
+    while (n > 0) {
+        // 5552 bytes is the most that cannot overflow b before the modulo
+        size_t chunk = std::min<size_t>(n, 5552);
+        n -= chunk;
+        while (chunk--) {
+            a += *p++;
+            b += a;
+        }
+        a %= ADLER_MOD;
+        b %= ADLER_MOD;
+    }
+    return a | (b << 16);
+}
+
+// Adler-32 of A followed by B, given those of A and B and B's length
+inline uint32_t adler32_combine(uint32_t adler_a, uint32_t adler_b, size_t len_b) {
+    uint32_t rem = static_cast<uint32_t>(len_b % ADLER_MOD);
+    uint32_t a = adler_a & 0xffff;
+    uint32_t b = static_cast<uint32_t>((uint64_t(rem) * a) % ADLER_MOD);
+    a += (adler_b & 0xffff) + ADLER_MOD - 1;
+    b += (adler_a >> 16) + (adler_b >> 16) + ADLER_MOD - rem;
+    if (a >= ADLER_MOD) a -= ADLER_MOD;
+    if (a >= ADLER_MOD) a -= ADLER_MOD;
+    if (b >= 2 * ADLER_MOD) b -= 2 * ADLER_MOD;
+    if (b >= ADLER_MOD) b -= ADLER_MOD;
+    return a | (b << 16);
+}
+
+// Deflate packs bits from the least significant end
+class BitWriter {
+public:
+    explicit BitWriter(std::string& out) : out(out) {}
+
+    void put(uint32_t value, int n) {
+        bits |= uint64_t(value) << count;
+        count += n;
+        while (count >= 8) {
+            out.push_back(static_cast<char>(bits & 0xff));
+            bits >>= 8;
+            count -= 8;
+        }
+    }
+
+    void align() {
+        if (count > 0) put(0, 8 - count);
+    }
+
+private:
+    std::string& out;
+    uint64_t bits{0};
+    int count{0};
+};
+
+constexpr uint16_t LEN_BASE[29] = {3,  4,  5,  6,  7,  8,  9,  10, 11,  13,  15,  17,  19,  23, 27,
+                                   31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+constexpr uint8_t LEN_EXTRA[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2,
+                                   2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+constexpr uint16_t DIST_BASE[30] = {1,   2,   3,   4,   5,   7,    9,    13,   17,   25,   33,   49,   65,    97,    129,
+                                    193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+
+// The fixed Huffman code of RFC 1951 3.2.6, bit reversed for BitWriter
+struct FixedCodes {
+    uint16_t lit[288];
+    uint8_t lit_bits[288];
+    uint16_t dist[30];
+    uint8_t len_code[259]; // match length -> index into LEN_BASE
+
+    FixedCodes() {
+        auto reverse = [](uint32_t v, int n) {
+            uint32_t r = 0;
+            for (int i = 0; i < n; ++i, v >>= 1) r = (r << 1) | (v & 1);
+            return static_cast<uint16_t>(r);
+        };
+        for (int s = 0; s < 288; ++s) {
+            if (s < 144)      lit_bits[s] = 8, lit[s] = reverse(0x30 + s, 8);
+            else if (s < 256) lit_bits[s] = 9, lit[s] = reverse(0x190 + s - 144, 9);
+            else if (s < 280) lit_bits[s] = 7, lit[s] = reverse(s - 256, 7);
+            else              lit_bits[s] = 8, lit[s] = reverse(0xc0 + s - 280, 8);
+        }
+        for (int d = 0; d < 30; ++d) dist[d] = reverse(d, 5);
+        for (int c = 0; c < 29; ++c)
+            for (int l = LEN_BASE[c]; l < LEN_BASE[c] + (1 << LEN_EXTRA[c]) && l <= 258; ++l) len_code[l] = c;
+    }
+};
+
+inline const FixedCodes& fixed_codes() {
+    static const FixedCodes codes;
+    return codes;
+}
+
+constexpr size_t WINDOW = 32768;
+constexpr size_t MAX_MATCH = 258;
+constexpr int HASH_BITS = 15;
+
+// Length of the common prefix of a and b, at most limit. a may overlap b.
+inline size_t match_length(const uint8_t* a, const uint8_t* b, size_t limit) {
+    size_t l = 0;
+    while (l + 8 <= limit) {
+        uint64_t x, y;
+        std::memcpy(&x, a + l, 8);
+        std::memcpy(&y, b + l, 8);
+        if (x != y) return l + (__builtin_ctzll(x ^ y) >> 3);
+        l += 8;
+    }
+    while (l < limit && a[l] == b[l]) ++l;
+    return l;
+}
+
+// Compress p[0, n) as one fixed Huffman block. A non-final block is
+// followed by an empty stored block, which leaves the output byte
+// aligned so separately compressed pieces can simply be concatenated.
+inline void deflate_fixed(const uint8_t* p, size_t n, bool last, Deflate mode, std::string& out) {
+    const FixedCodes& fc = fixed_codes();
+    BitWriter bw(out);
+    bw.put(last ? 1 : 0, 1);
+    bw.put(1, 2); // BTYPE 01: fixed Huffman
+
+    auto literal = [&](uint32_t s) { bw.put(fc.lit[s], fc.lit_bits[s]); };
+    auto match = [&](size_t len, size_t dist) {
+        int c = fc.len_code[len];
+        literal(257 + c);
+        if (LEN_EXTRA[c]) bw.put(static_cast<uint32_t>(len - LEN_BASE[c]), LEN_EXTRA[c]);
+        uint32_t x = static_cast<uint32_t>(dist - 1);
+        int d = x < 4 ? x : 2 * (31 - __builtin_clz(x)) + ((x >> (30 - __builtin_clz(x))) & 1);
+        bw.put(fc.dist[d], 5);
+        if (d >= 4) bw.put(static_cast<uint32_t>(dist - DIST_BASE[d]), d / 2 - 1);
+    };
+
+    std::vector<int32_t> head;
+    if (mode == Deflate::Fast) head.assign(size_t(1) << HASH_BITS, -1);
+
+    size_t i = 0;
+    while (i < n) {
+        size_t limit = std::min(MAX_MATCH, n - i);
+        size_t best_len = 0, best_dist = 0;
+        if (i > 0) {
+            best_len = match_length(p + i - 1, p + i, limit);
+            best_dist = 1;
+        }
+        if (mode == Deflate::Fast && best_len < limit && limit >= 4) {
+            uint32_t v;
+            std::memcpy(&v, p + i, 4);
+            uint32_t h = (v * 2654435761u) >> (32 - HASH_BITS);
+            int32_t cand = head[h];
+            head[h] = static_cast<int32_t>(i);
+            if (cand >= 0 && i - cand <= WINDOW && i - cand > 1) {
+                size_t len = match_length(p + cand, p + i, limit);
+                if (len > best_len) best_len = len, best_dist = i - cand;
+            }
+        }
+        if (best_len >= 3) {
+            match(best_len, best_dist);
+            i += best_len;
+        } else {
+            literal(p[i++]);
+        }
+    }
+    literal(256);
+
+    if (!last) {
+        bw.put(0, 3); // BFINAL 0, BTYPE 00: stored
+        bw.align();
+        out.append("\x00\x00\xff\xff", 4);
+    }
+    bw.align();
+}
+
+inline uint8_t paeth(int a, int b, int c) {
+    int p = a + b - c;
+    int pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+    if (pa <= pb && pa <= pc) return static_cast<uint8_t>(a);
+    return static_cast<uint8_t>(pb <= pc ? b : c);
+}
+
+// Filter one RGB row into out (filter type byte first), picking the
+// filter with the smallest sum of absolute signed bytes per row as the
+// PNG specification suggests. prev is null for the first row.
+inline void filter_row(const uint8_t* row, const uint8_t* prev, size_t stride, uint8_t* out,
+                       std::vector<uint8_t>& scratch) {
+    const int bpp = 3;
+    scratch.resize(4 * stride);
+    uint8_t* cand[4] = {scratch.data(), scratch.data() + stride, scratch.data() + 2 * stride,
+                        scratch.data() + 3 * stride};
+    for (size_t i = 0; i < stride; ++i) {
+        int a = i >= bpp ? row[i - bpp] : 0;
+        int b = prev ? prev[i] : 0;
+        int c = prev && i >= bpp ? prev[i - bpp] : 0;
+        cand[0][i] = static_cast<uint8_t>(row[i] - a);
+        cand[1][i] = static_cast<uint8_t>(row[i] - b);
+        cand[2][i] = static_cast<uint8_t>(row[i] - ((a + b) >> 1));
+        cand[3][i] = static_cast<uint8_t>(row[i] - paeth(a, b, c));
+    }
+    auto cost = [&](const uint8_t* r) {
+        uint64_t s = 0;
+        for (size_t i = 0; i < stride; ++i) s += std::abs(static_cast<int8_t>(r[i]));
+        return s;
+    };
+    uint64_t best = 0;
+    for (size_t i = 0; i < stride; ++i) best += row[i] < 128 ? row[i] : 256 - row[i];
+    int type = 0;
+    for (int f = 0; f < 4; ++f) {
+        uint64_t c = cost(cand[f]);
+        if (c < best) best = c, type = f + 1;
+    }
+    out[0] = static_cast<uint8_t>(type);
+    std::memcpy(out + 1, type ? cand[type - 1] : row, stride);
+}
+
+// Row y of bmp as RGB triples, whatever the canvas format
+inline void rgb_row(const BMP& bmp, int y, uint8_t* out) {
+    const uint8_t* src = bmp.row(y);
+    const int width = bmp.get_width();
+    if (bmp.bits_per_pixel() == 24) {
+        for (int x = 0; x < width; ++x) {
+            out[3 * x] = src[3 * x + 2];
+            out[3 * x + 1] = src[3 * x + 1];
+            out[3 * x + 2] = src[3 * x];
+        }
+        return;
+    }
+    const std::vector<color>& colors = bmp.palette();
+    for (int x = 0; x < width; ++x) {
+        uint32_t i = bmp.bits_per_pixel() == 8 ? src[x] : (src[x >> 3] >> (7 - (x & 7))) & 1;
+        const color& c = colors[i < colors.size() ? i : 0];
+        out[3 * x] = static_cast<uint8_t>(c.r);
+        out[3 * x + 1] = static_cast<uint8_t>(c.g);
+        out[3 * x + 2] = static_cast<uint8_t>(c.b);
+    }
+}
+
+inline void put_u32(std::string& out, uint32_t v) {
+    char b[4] = {char(v >> 24), char(v >> 16), char(v >> 8), char(v)};
+    out.append(b, 4);
+}
+
+inline void put_chunk(std::string& out, const char* type, const std::string& data) {
+    put_u32(out, static_cast<uint32_t>(data.size()));
+    size_t start = out.size();
+    out.append(type, 4);
+    out += data;
+    put_u32(out, crc32(0, reinterpret_cast<const uint8_t*>(out.data() + start), out.size() - start));
+}
+
+} // namespace detail
+
+// Encode bmp as a PNG file image. Stripes of rows are filtered and
+// compressed independently (on opt.pool when given) and joined into one
+// zlib stream, with the Adler-32 checksums combined at the end.
+inline std::string encode(const BMP& bmp, const Options& opt = {}) {
+    using namespace detail;
+    const int width = bmp.get_width(), height = bmp.get_height();
+
+    // Collect a palette while there are at most 256 colors
+    std::unordered_map<uint32_t, uint8_t> index;
+    std::vector<uint32_t> palette;
+    if (opt.palette) {
+        uint32_t last = 0xffffffff;
+        std::vector<uint8_t> row(size_t(width) * 3);
+        for (int y = 0; y < height && palette.size() <= 256; ++y) {
+            rgb_row(bmp, y, row.data());
+            for (int x = 0; x < width; ++x) {
+                uint32_t rgb = uint32_t(row[3 * x]) << 16 | uint32_t(row[3 * x + 1]) << 8 | row[3 * x + 2];
+                if (rgb == last) continue;
+                last = rgb;
+                if (index.emplace(rgb, static_cast<uint8_t>(palette.size())).second) {
+                    palette.push_back(rgb);
+                    if (palette.size() > 256) break;
+                }
+            }
+        }
+        if (palette.size() > 256) palette.clear();
+    }
+    const bool indexed = !palette.empty();
+    const int depth = !indexed ? 8 : palette.size() <= 2 ? 1 : palette.size() <= 4 ? 2 : palette.size() <= 16 ? 4 : 8;
+    const size_t stride = indexed ? (size_t(width) * depth + 7) / 8 : size_t(width) * 3;
+
+    const int stripe_rows = std::max(1, opt.stripe_rows);
+    const size_t stripes = std::max<size_t>(1, (height + stripe_rows - 1) / stripe_rows);
+    std::vector<std::string> parts(stripes);
+    std::vector<uint32_t> adlers(stripes);
+    std::vector<size_t> lengths(stripes);
+
+    auto compress_stripe = [&](size_t s) {
+        int y0 = static_cast<int>(s) * stripe_rows, y1 = std::min(height, y0 + stripe_rows);
+        std::vector<uint8_t> raw(size_t(y1 - y0) * (stride + 1));
+        std::vector<uint8_t> cur(size_t(width) * 3), prev(size_t(width) * 3), scratch;
+        for (int y = y0; y < y1; ++y) {
+            rgb_row(bmp, y, cur.data());
+            uint8_t* out = raw.data() + size_t(y - y0) * (stride + 1);
+            if (indexed) {
+                // Palette rows stay unfiltered, which compresses best for them
+                out[0] = 0;
+                std::memset(out + 1, 0, stride);
+                uint32_t last = 0xffffffff, i = 0;
+                for (int x = 0; x < width; ++x) {
+                    uint32_t rgb = uint32_t(cur[3 * x]) << 16 | uint32_t(cur[3 * x + 1]) << 8 | cur[3 * x + 2];
+                    if (rgb != last) last = rgb, i = index.find(rgb)->second;
+                    size_t bit = size_t(x) * depth;
+                    out[1 + bit / 8] |= static_cast<uint8_t>(i << (8 - depth - bit % 8));
+                }
+            } else {
+                // The first row of a stripe is filtered against the row above it
+                if (y == y0 && y > 0) rgb_row(bmp, y - 1, prev.data());
+                filter_row(cur.data(), y == 0 ? nullptr : prev.data(), stride, out, scratch);
+                std::swap(cur, prev);
+            }
+        }
+        deflate_fixed(raw.data(), raw.size(), s + 1 == stripes, opt.mode, parts[s]);
+        adlers[s] = adler32(1, raw.data(), raw.size());
+        lengths[s] = raw.size();
+    };
+
+    if (opt.pool && stripes > 1) opt.pool->parallel_for(stripes, compress_stripe);
+    else for (size_t s = 0; s < stripes; ++s) compress_stripe(s);
+
+    uint32_t adler = adlers[0];
+    for (size_t s = 1; s < stripes; ++s) adler = adler32_combine(adler, adlers[s], lengths[s]);
+
+    std::string out("\x89PNG\r\n\x1a\n", 8);
+    std::string ihdr;
+    put_u32(ihdr, width);
+    put_u32(ihdr, height);
+    ihdr += static_cast<char>(depth);
+    ihdr += static_cast<char>(indexed ? 3 : 2); // color type: palette or RGB
+    ihdr.append("\0\0\0", 3);                     // deflate, adaptive filtering, no interlace
+    put_chunk(out, "IHDR", ihdr);
+
+    if (indexed) {
+        std::string plte;
+        for (uint32_t rgb : palette) {
+            plte += static_cast<char>(rgb >> 16);
+            plte += static_cast<char>(rgb >> 8);
+            plte += static_cast<char>(rgb);
+        }
+        put_chunk(out, "PLTE", plte);
+    }
+
+    // One IDAT per stripe; the zlib header and checksum ride on the ends
+    parts.front().insert(0, "\x78\x01", 2);
+    put_u32(parts.back(), adler);
+    for (const std::string& part : parts) put_chunk(out, "IDAT", part);
+    put_chunk(out, "IEND", "");
+    return out;
+}
+
+inline void write(const BMP& bmp, const std::string& file_name, const Options& opt = {}) {
+    std::string data = encode(bmp, opt);
+    std::ofstream out(file_name, std::ios::binary);
+    if (!out) throw std::runtime_error("Failed to open " + file_name + " for writing.");
+    out.write(data.data(), data.size());
+}
+
+} // namespace png
@@ -0,0 +1,280 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "osm.hpp"
+#include "spatial.hpp"
+#include "threadpool.hpp"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PROJECT_X86 1
+#endif
+
+// Web Mercator (EPSG:3857) in tile units: the world is 2^z tiles wide
+inline double lon_to_tile_x(double lon, int z) {
+    return (lon + 180.0) / 360.0 * (1 << z);
+}
+
+inline double lat_to_tile_y(double lat, int z) {
+    double r = lat * M_PI / 180.0;
+    return (1.0 - std::log(std::tan(r) + 1.0 / std::cos(r)) / M_PI) / 2.0 * (1 << z);
+}
+
+inline double tile_x_to_lon(double x, int z) {
+    return x / (1 << z) * 360.0 - 180.0;
+}
+
+inline double tile_y_to_lat(double y, int z) {
+    double n = M_PI - 2.0 * M_PI * y / (1 << z);
+    return 180.0 / M_PI * std::atan(std::sinh(n));
+}
+
+// Projection stage: every node is projected once into an array of
+// pixel coordinates, indexed like OsmData::nodes, and renderers read
+// positions from there.
+//
+// World coordinates are Web Mercator in units of the whole map, x and y
+// in [0, 1) with y growing south, or for the linear projection plain
+// degrees with y = -lat. A View maps them to pixels with an offset and
+// a scale per axis.
+//
+// The Mercator kernels compute sin and log with their own polynomials
+// rather than libm, so the scalar and AVX2 versions do the same IEEE
+// operations in the same order and give identical results. The kernel is
+// picked once at runtime from the CPU features; OSM_PROJECT=scalar|avx2
+// overrides it for comparisons.
+
+enum class Projection { Mercator, Linear };
+
+inline Projection parse_projection(std::string_view s) {
+    if (s == "mercator") return Projection::Mercator;
+    if (s == "linear") return Projection::Linear;
+    throw std::runtime_error("Unknown projection '" + std::string(s) + "', expected mercator or linear");
+}
+
+struct ScreenPoint {
+    double x, y;
+};
+
+// World to pixels: px = (world - origin) * scale
+struct View {
+    Projection projection{Projection::Mercator};
+    double x0{0}, y0{0};
+    double sx{1}, sy{1};
+    double zoom{0}; // web map zoom with the same pixels per degree at the center
+
+    // Fit box into a width x height picture. Mercator keeps the aspect
+    // ratio and centers the box; linear stretches each axis to fill.
+    static View fit(Projection p, const BBox& box, int width, int height);
+
+    // Mercator world scaled to 256 px tiles at zoom, as tiles are cut
+    static View tiles(int zoom) {
+        double s = 256.0 * std::pow(2.0, zoom);
+        return {Projection::Mercator, 0, 0, s, s, static_cast<double>(zoom)};
+    }
+};
+
+namespace project_detail {
+
+// Latitude where Web Mercator makes the map square
+constexpr double MAX_LAT = 85.05112877980659;
+constexpr double DEG = M_PI / 180;
+constexpr double SQRT2 = 1.4142135623730951;
+constexpr double LN2 = 0.6931471805599453;
+constexpr double INV_4PI = 1 / (4 * M_PI);
+
+// Taylor coefficients of sin x / x in x^2, highest first; enough terms
+// for full precision up to |x| = MAX_LAT in radians
+constexpr double SIN_C[] = {1.0 / 51090942171709440000.0, -1.0 / 121645100408832000.0,
+                            1.0 / 355687428096000.0,      -1.0 / 1307674368000.0,
+                            1.0 / 6227020800.0,           -1.0 / 39916800.0,
+                            1.0 / 362880.0,               -1.0 / 5040.0,
+                            1.0 / 120.0,                  -1.0 / 6.0,
+                            1.0};
+
+// atanh t / t in t^2, for |t| <= 3 - 2 sqrt 2
+constexpr double ATANH_C[] = {1.0 / 21, 1.0 / 19, 1.0 / 17, 1.0 / 15, 1.0 / 13, 1.0 / 11,
+                              1.0 / 9,  1.0 / 7,  1.0 / 5,  1.0 / 3,  1.0};
+
+constexpr uint64_t MANT_MASK = 0x000fffffffffffffull;
+constexpr uint64_t ONE_BITS = 0x3ff0000000000000ull;
+// 2^52 as bits; or-ing in a small integer gives 2^52 + that integer
+constexpr uint64_t TWO52_BITS = 0x4330000000000000ull;
+constexpr double TWO52 = 4503599627370496.0;
+
+// Mercator y in world units. ln((1 + sin) / (1 - sin)) / 2 is the usual
+// ln(tan + sec); the log splits off the exponent and takes 2 atanh t of
+// a mantissa m in [sqrt 1/2, sqrt 2), t = (m - 1) / (m + 1).
+inline double mercator_y_scalar(double lat) {
+    double x = std::min(std::max(lat, -MAX_LAT), MAX_LAT) * DEG;
+    double x2 = x * x, p = SIN_C[0];
+    for (int i = 1; i < 11; ++i) p = p * x2 + SIN_C[i];
+    double s = x * p;
+    double q = (1 + s) / (1 - s);
+
+    uint64_t bits, mbits, ebits;
+    std::memcpy(&bits, &q, sizeof(bits));
+    mbits = (bits & MANT_MASK) | ONE_BITS;
+    ebits = (bits >> 52) | TWO52_BITS;
+    double m, e;
+    std::memcpy(&m, &mbits, sizeof(m));
+    std::memcpy(&e, &ebits, sizeof(e));
+    e = (e - TWO52) - 1023;
+    if (m > SQRT2) {
+        m = m * 0.5;
+        e = e + 1;
+    }
+    double t = (m - 1) / (m + 1), t2 = t * t;
+    p = ATANH_C[0];
+    for (int i = 1; i < 11; ++i) p = p * t2 + ATANH_C[i];
+    double ln_q = e * LN2 + 2 * t * p;
+    return 0.5 - ln_q * INV_4PI;
+}
+
+inline void project_scalar(const Node* in, size_t n, const View& v, ScreenPoint* out) {
+    if (v.projection == Projection::Linear) {
+        for (size_t i = 0; i < n; ++i)
+            out[i] = {(in[i].lon - v.x0) * v.sx, (-in[i].lat - v.y0) * v.sy};
+        return;
+    }
+    for (size_t i = 0; i < n; ++i)
+        out[i] = {((in[i].lon + 180) * (1.0 / 360) - v.x0) * v.sx, (mercator_y_scalar(in[i].lat) - v.y0) * v.sy};
+}
+
+#ifdef PROJECT_X86
+
+__attribute__((target("avx2")))
+inline __m256d mercator_y_avx2(__m256d lat) {
+    __m256d x = _mm256_mul_pd(_mm256_min_pd(_mm256_max_pd(lat, _mm256_set1_pd(-MAX_LAT)), _mm256_set1_pd(MAX_LAT)),
+                              _mm256_set1_pd(DEG));
+    __m256d x2 = _mm256_mul_pd(x, x), p = _mm256_set1_pd(SIN_C[0]);
+    for (int i = 1; i < 11; ++i) p = _mm256_add_pd(_mm256_mul_pd(p, x2), _mm256_set1_pd(SIN_C[i]));
+    __m256d s = _mm256_mul_pd(x, p);
+    const __m256d one = _mm256_set1_pd(1);
+    __m256d q = _mm256_div_pd(_mm256_add_pd(one, s), _mm256_sub_pd(one, s));
+
+    __m256i bits = _mm256_castpd_si256(q);
+    __m256d m = _mm256_castsi256_pd(_mm256_or_si256(_mm256_and_si256(bits, _mm256_set1_epi64x(MANT_MASK)),
+                                                    _mm256_set1_epi64x(ONE_BITS)));
+    __m256d e = _mm256_castsi256_pd(_mm256_or_si256(_mm256_srli_epi64(bits, 52), _mm256_set1_epi64x(TWO52_BITS)));
+    e = _mm256_sub_pd(_mm256_sub_pd(e, _mm256_set1_pd(TWO52)), _mm256_set1_pd(1023));
+    __m256d big = _mm256_cmp_pd(m, _mm256_set1_pd(SQRT2), _CMP_GT_OQ);
+    m = _mm256_blendv_pd(m, _mm256_mul_pd(m, _mm256_set1_pd(0.5)), big);
+    e = _mm256_blendv_pd(e, _mm256_add_pd(e, one), big);
+
+    __m256d t = _mm256_div_pd(_mm256_sub_pd(m, one), _mm256_add_pd(m, one));
+    __m256d t2 = _mm256_mul_pd(t, t);
+    p = _mm256_set1_pd(ATANH_C[0]);
+    for (int i = 1; i < 11; ++i) p = _mm256_add_pd(_mm256_mul_pd(p, t2), _mm256_set1_pd(ATANH_C[i]));
+    __m256d ln_q = _mm256_add_pd(_mm256_mul_pd(e, _mm256_set1_pd(LN2)),
+                                 _mm256_mul_pd(_mm256_mul_pd(_mm256_set1_pd(2), t), p));
+    return _mm256_sub_pd(_mm256_set1_pd(0.5), _mm256_mul_pd(ln_q, _mm256_set1_pd(INV_4PI)));
+}
+
+// Four nodes at a time. Unpacking the interleaved lat/lon pairs leaves
+// the lanes in order 0 2 1 3, and unpacking x and y again undoes it.
+__attribute__((target("avx2")))
+inline void project_avx2(const Node* in, size_t n, const View& v, ScreenPoint* out) {
+    static_assert(sizeof(Node) == 2 * sizeof(double) && sizeof(ScreenPoint) == 2 * sizeof(double));
+    const bool merc = v.projection == Projection::Mercator;
+    const __m256d x0 = _mm256_set1_pd(v.x0), y0 = _mm256_set1_pd(v.y0);
+    const __m256d sx = _mm256_set1_pd(v.sx), sy = _mm256_set1_pd(v.sy);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        const double* p = reinterpret_cast<const double*>(in + i);
+        __m256d a = _mm256_loadu_pd(p), b = _mm256_loadu_pd(p + 4);
+        __m256d lat = _mm256_unpacklo_pd(a, b), lon = _mm256_unpackhi_pd(a, b);
+        __m256d wx, wy;
+        if (merc) {
+            wx = _mm256_mul_pd(_mm256_add_pd(lon, _mm256_set1_pd(180)), _mm256_set1_pd(1.0 / 360));
+            wy = mercator_y_avx2(lat);
+        } else {
+            wx = lon;
+            wy = _mm256_sub_pd(_mm256_setzero_pd(), lat);
+        }
+        __m256d x = _mm256_mul_pd(_mm256_sub_pd(wx, x0), sx);
+        __m256d y = _mm256_mul_pd(_mm256_sub_pd(wy, y0), sy);
+        double* o = reinterpret_cast<double*>(out + i);
+        _mm256_storeu_pd(o, _mm256_unpacklo_pd(x, y));
+        _mm256_storeu_pd(o + 4, _mm256_unpackhi_pd(x, y));
+    }
+    project_scalar(in + i, n - i, v, out + i);
+}
+
+#endif // PROJECT_X86
+
+} // namespace project_detail
+
+struct ProjectKernel {
+    const char* name;
+    void (*project)(const Node* in, size_t n, const View& v, ScreenPoint* out);
+};
+
+inline ProjectKernel select_project_kernel() {
+    const char* force = std::getenv("OSM_PROJECT");
+    std::string_view want = force ? force : "";
+    ProjectKernel scalar{"scalar", project_detail::project_scalar};
+    if (want == "scalar") return scalar;
+#ifdef PROJECT_X86
+    ProjectKernel avx2{"avx2", project_detail::project_avx2};
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") ? avx2 : scalar;
+#else
+    return scalar;
+#endif
+}
+
+inline const ProjectKernel& project_kernel() {
+    static const ProjectKernel k = select_project_kernel();
+    return k;
+}
+
+// World coordinates of a single point, for bounds and the like
+inline ScreenPoint project_point(Projection p, double lat, double lon) {
+    View world{p};
+    Node n{lat, lon};
+    ScreenPoint s;
+    project_detail::project_scalar(&n, 1, world, &s);
+    return s;
+}
+
+inline View View::fit(Projection p, const BBox& box, int width, int height) {
+    View v{p};
+    ScreenPoint a = project_point(p, box.max_lat, box.min_lon); // top left
+    ScreenPoint b = project_point(p, box.min_lat, box.max_lon); // bottom right
+    double w = std::max(b.x - a.x, 1e-12), h = std::max(b.y - a.y, 1e-12);
+    if (p == Projection::Mercator) {
+        v.sx = v.sy = std::min(width / w, height / h);
+        v.x0 = (a.x + b.x) / 2 - width / 2.0 / v.sx;
+        v.y0 = (a.y + b.y) / 2 - height / 2.0 / v.sy;
+        v.zoom = std::log2(v.sx / 256);
+    } else {
+        v.sx = width / w;
+        v.sy = height / h;
+        v.x0 = a.x;
+        v.y0 = a.y;
+        // 256 * 2^z pixels per 360 degrees of longitude, and Mercator
+        // stretches latitude by 1 / cos(lat)
+        double mid_lat = (box.min_lat + box.max_lat) / 2 * M_PI / 180;
+        v.zoom = std::log2(std::max(v.sx, v.sy * std::cos(mid_lat)) * 360 / 256);
+    }
+    return v;
+}
+
+// Pixel positions of all nodes in view v, projected in blocks on the pool
+inline std::vector<ScreenPoint> project_nodes(const std::vector<Node>& nodes, const View& v, ThreadPool& pool) {
+    constexpr size_t BLOCK = 16384;
+    std::vector<ScreenPoint> out(nodes.size());
+    const ProjectKernel& k = project_kernel();
+    pool.parallel_for((nodes.size() + BLOCK - 1) / BLOCK, [&](size_t b) {
+        size_t begin = b * BLOCK, n = std::min(BLOCK, nodes.size() - begin);
+        k.project(nodes.data() + begin, n, v, out.data() + begin);
+    });
+    return out;
+}
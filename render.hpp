@@ -0,0 +1,183 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <cmath>
+#include <string>
+#include <vector>
+#include "bmp.hpp"
+#include "threadpool.hpp"
+
+// One line to draw, already in pixel coordinates
+struct Segment {
+    int x0, y0, x1, y1;
+    color c;
+    float width{1}; // used by the anti-aliased renderer
+};
+
+// Draw s into bmp moved up by dy rows, clipped to clip
+inline void draw_segment(BMP& bmp, const Segment& s, int dy, bool antialias, const Rect& clip) {
+    if (antialias)
+        draw_wide_line(bmp, s.x0 + 0.5, s.y0 - dy + 0.5, s.x1 + 0.5, s.y1 - dy + 0.5, s.width, s.c, clip);
+    else
+        draw_line(bmp, s.x0, s.y0 - dy, s.x1, s.y1 - dy, s.c, clip);
+}
+
+// Filled polygons to draw under the segments, in pixel coordinates. Area
+// a has rings [area_start[a], area_start[a + 1]), and ring r has the
+// points [ring_start[r], ring_start[r + 1]), all in flat arrays.
+struct Areas {
+    std::vector<PolyPoint> points;
+    std::vector<uint32_t> ring_start{0};
+    std::vector<uint32_t> area_start{0};
+    std::vector<color> fill; // per area
+    FillRule rule{FillRule::EvenOdd};
+
+    size_t size() const { return fill.size(); }
+
+    // Points go in with add_point until end_ring; rings with fewer than
+    // three points are dropped. end_area makes an area of the rings since
+    // the last one, if any.
+    void add_point(double x, double y) { points.push_back({x, y}); }
+    void end_ring() {
+        if (points.size() - ring_start.back() >= 3) ring_start.push_back(static_cast<uint32_t>(points.size()));
+        else points.resize(ring_start.back());
+    }
+    void end_area(const color& c) {
+        uint32_t rings = static_cast<uint32_t>(ring_start.size()) - 1;
+        if (rings == area_start.back()) return;
+        area_start.push_back(rings);
+        fill.push_back(c);
+    }
+};
+
+// Fill area a of areas into bmp moved up by dy rows, clipped to clip
+inline void draw_area(BMP& bmp, const Areas& areas, uint32_t a, int dy, const Rect& clip) {
+    uint32_t first = areas.area_start[a];
+    fill_polygon(bmp, areas.points.data(), areas.ring_start.data() + first, areas.area_start[a + 1] - first,
+                 areas.fill[a], areas.rule, clip, dy);
+}
+
+// Item indexes per horizontal band of the canvas, in one flat array
+struct BandBins {
+    int band_height{0};
+    std::vector<uint32_t> start; // band b owns items[start[b], start[b + 1])
+    std::vector<uint32_t> items;
+
+    int bands() const { return static_cast<int>(start.size()) - 1; }
+};
+
+// Bin count items by the bands the rows range(i, y_min, y_max) gives for
+// item i touch. Items entirely above or below the canvas are dropped.
+// Within a band the original order is kept, so later items still draw
+// over earlier ones.
+template <typename Range>
+BandBins bin_rows(size_t count, int height, int band_height, Range range) {
+    BandBins bins;
+    bins.band_height = band_height;
+    int bands = std::max(1, (height + band_height - 1) / band_height);
+    bins.start.assign(bands + 1, 0);
+
+    auto span = [&](uint32_t i, int& lo, int& hi) {
+        int y_min, y_max;
+        range(i, y_min, y_max);
+        if (y_max < 0 || y_min >= height) return false;
+        lo = std::max(y_min, 0) / band_height;
+        hi = std::min(y_max, height - 1) / band_height;
+        return true;
+    };
+
+    int lo, hi;
+    for (uint32_t i = 0; i < count; ++i)
+        if (span(i, lo, hi))
+            for (int b = lo; b <= hi; ++b) ++bins.start[b + 1];
+    for (int b = 0; b < bands; ++b) bins.start[b + 1] += bins.start[b];
+
+    bins.items.resize(bins.start[bands]);
+    std::vector<uint32_t> fill(bins.start.begin(), bins.start.end() - 1);
+    for (uint32_t i = 0; i < count; ++i)
+        if (span(i, lo, hi))
+            for (int b = lo; b <= hi; ++b) bins.items[fill[b]++] = i;
+    return bins;
+}
+
+// Bin segments by the bands their y-range touches. Anti-aliased segments
+// reach half their width plus a pixel further.
+inline BandBins bin_segments(const std::vector<Segment>& segs, int height, int band_height, bool antialias = false) {
+    return bin_rows(segs.size(), height, band_height, [&](uint32_t i, int& y_min, int& y_max) {
+        const Segment& s = segs[i];
+        int pad = antialias ? static_cast<int>(std::ceil(s.width / 2)) + 1 : 0;
+        y_min = std::min(s.y0, s.y1) - pad;
+        y_max = std::max(s.y0, s.y1) + pad;
+    });
+}
+
+// Bin areas by the bands their bounding box touches
+inline BandBins bin_areas(const Areas& areas, int height, int band_height) {
+    return bin_rows(areas.size(), height, band_height, [&](uint32_t a, int& y_min, int& y_max) {
+        double lo = HUGE_VAL, hi = -HUGE_VAL;
+        for (uint32_t p = areas.ring_start[areas.area_start[a]]; p < areas.ring_start[areas.area_start[a + 1]]; ++p) {
+            lo = std::min(lo, areas.points[p].y);
+            hi = std::max(hi, areas.points[p].y);
+        }
+        const double limit = 1 << 30;
+        y_min = static_cast<int>(std::floor(std::clamp(lo, -limit, limit)));
+        y_max = static_cast<int>(std::floor(std::clamp(hi, -limit, limit)));
+    });
+}
+
+// Draw areas and then segs into bmp on the pool. Each band is rasterized
+// by one worker, filling all the areas touching it before drawing its
+// segments, and only its own rows are written, so no locking is needed
+// and the image is the same as drawing everything in order on one thread.
+inline void render_segments(BMP& bmp, const Areas& areas, const std::vector<Segment>& segs, ThreadPool& pool,
+                            bool antialias = false, int band_height = 64) {
+    BandBins area_bins = bin_areas(areas, bmp.get_height(), band_height);
+    BandBins bins = bin_segments(segs, bmp.get_height(), band_height, antialias);
+    pool.parallel_for(bins.bands(), [&](size_t b) {
+        Rect clip{0, static_cast<int>(b) * band_height, bmp.get_width(),
+                  std::min(bmp.get_height(), static_cast<int>(b + 1) * band_height)};
+        for (uint32_t i = area_bins.start[b]; i < area_bins.start[b + 1]; ++i)
+            draw_area(bmp, areas, area_bins.items[i], 0, clip);
+        for (uint32_t i = bins.start[b]; i < bins.start[b + 1]; ++i) {
+            draw_segment(bmp, segs[bins.items[i]], 0, antialias, clip);
+        }
+    });
+}
+
+// Render areas and segs straight to a width x height BMP file, holding only a few
+// bands in memory: one per pool worker. Each round rasterizes the next
+// bands up from the bottom in parallel, shifted so the band starts at
+// row 0 (all the rasterizers are translation invariant, so pixels are unchanged),
+// then appends them to the file in bottom-up order.
+// bits_per_pixel and palette select the BMP pixel format as for BMP.
+inline void render_segments_to_file(const std::string& file_name, int width, int height, const Areas& areas,
+                                    const std::vector<Segment>& segs, ThreadPool& pool, int bits_per_pixel = 24,
+                                    const std::vector<color>& palette = {}, bool antialias = false,
+                                    int band_height = 64) {
+    BandBins area_bins = bin_areas(areas, height, band_height);
+    BandBins bins = bin_segments(segs, height, band_height, antialias);
+    BMPStreamWriter writer(file_name, width, height, bits_per_pixel, palette);
+    std::vector<BMP> bands;
+
+    for (int top = bins.bands(); top > 0;) {
+        int round = std::min(static_cast<int>(pool.size()), top);
+        bands.clear();
+        for (int j = 0; j < round; ++j) {
+            int b = top - 1 - j;
+            bands.emplace_back(width, std::min(height, (b + 1) * band_height) - b * band_height, bits_per_pixel, palette);
+        }
+        pool.parallel_for(round, [&](size_t j) {
+            int b = top - 1 - static_cast<int>(j);
+            int y0 = b * band_height;
+            BMP& band = bands[j];
+            Rect clip{0, 0, width, band.get_height()};
+            for (uint32_t i = area_bins.start[b]; i < area_bins.start[b + 1]; ++i)
+                draw_area(band, areas, area_bins.items[i], y0, clip);
+            for (uint32_t i = bins.start[b]; i < bins.start[b + 1]; ++i)
+                draw_segment(band, segs[bins.items[i]], y0, antialias, clip);
+        });
+        for (const BMP& band : bands) writer.write_band(band);
+        top -= round;
+    }
+    writer.finish();
+}
@@ -0,0 +1,163 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <queue>
+#include <vector>
+#include "osm.hpp"
+
+// Road network of the ways in an OsmData, built once for many queries.
+//
+// Graph nodes are the OSM nodes some way passes through, numbered
+// densely; the edges leaving node u are edges[first[u], first[u + 1]),
+// one array for the whole graph. Each segment of a way is an edge both
+// ways unless the way is oneway=yes. Lengths are great circle distances
+// in km, as graph does.
+
+constexpr double EARTH_RADIUS_KM = 6371.0;
+
+inline double haversine_km(const Node& a, const Node& b) {
+    constexpr double deg = M_PI / 180;
+    double dlat = (b.lat - a.lat) * deg, dlon = (b.lon - a.lon) * deg;
+    double h = std::sin(dlat / 2) * std::sin(dlat / 2) +
+               std::cos(a.lat * deg) * std::cos(b.lat * deg) * std::sin(dlon / 2) * std::sin(dlon / 2);
+    return 2 * EARTH_RADIUS_KM * std::atan2(std::sqrt(h), std::sqrt(1 - h));
+}
+
+struct RoadGraph {
+    static constexpr uint32_t NONE = 0xffffffff;
+
+    struct Edge {
+        uint32_t to;
+        uint32_t way; // index into OsmData::ways
+        double km;
+    };
+
+    std::vector<uint32_t> osm_node; // graph node -> OsmData node index
+    std::vector<uint32_t> node_of;  // OsmData node index -> graph node, or NONE
+    std::vector<uint32_t> first;
+    std::vector<Edge> edges;
+
+    size_t size() const { return osm_node.size(); }
+
+    // Graph node of an OSM node id, or NONE
+    uint32_t find(const OsmData& osm, long long id) const {
+        uint32_t n = osm.find_node(id);
+        return n == NO_NODE ? NONE : node_of[n];
+    }
+};
+
+inline RoadGraph build_road_graph(const OsmData& osm) {
+    RoadGraph g;
+    const uint32_t k_oneway = osm.tags.dict.find("oneway");
+    const uint32_t v_yes = osm.tags.dict.find("yes");
+
+    // Number the nodes in OsmData order, then count and place edges
+    g.node_of.assign(osm.nodes.size(), RoadGraph::NONE);
+    for (const Way& way : osm.ways)
+        for (const uint32_t* n = osm.way_begin(way); n != osm.way_end(way); ++n)
+            if (*n != NO_NODE) g.node_of[*n] = 0;
+    for (uint32_t n = 0; n < osm.nodes.size(); ++n) {
+        if (g.node_of[n] == RoadGraph::NONE) continue;
+        g.node_of[n] = static_cast<uint32_t>(g.osm_node.size());
+        g.osm_node.push_back(n);
+    }
+
+    auto for_each_edge = [&](auto&& fn) {
+        for (uint32_t w = 0; w < osm.ways.size(); ++w) {
+            const Way& way = osm.ways[w];
+            bool oneway = osm.tags.has(way.tags, k_oneway, v_yes);
+            const uint32_t* refs = osm.way_begin(way);
+            for (uint32_t i = 1; i < way.node_count; ++i) {
+                if (refs[i - 1] == NO_NODE || refs[i] == NO_NODE) continue;
+                uint32_t a = g.node_of[refs[i - 1]], b = g.node_of[refs[i]];
+                fn(a, b, w);
+                if (!oneway) fn(b, a, w);
+            }
+        }
+    };
+    g.first.assign(g.size() + 1, 0);
+    for_each_edge([&](uint32_t a, uint32_t, uint32_t) { ++g.first[a + 1]; });
+    for (size_t u = 0; u < g.size(); ++u) g.first[u + 1] += g.first[u];
+    g.edges.resize(g.first.back());
+    std::vector<uint32_t> fill(g.first.begin(), g.first.end() - 1);
+    for_each_edge([&](uint32_t a, uint32_t b, uint32_t w) {
+        g.edges[fill[a]++] = {b, w, haversine_km(osm.nodes[g.osm_node[a]], osm.nodes[g.osm_node[b]])};
+    });
+    return g;
+}
+
+// Shortest paths on a RoadGraph by A*, guided by the straight line
+// distance to the target, which never overestimates since every edge is
+// at least that long. Keeps its arrays between queries and clears them
+// by generation, so one searcher per thread answers queries without
+// allocating or touching the whole graph.
+class RouteSearch {
+public:
+    explicit RouteSearch(const RoadGraph& g, const OsmData& osm)
+        : g(g), osm(osm), dist(g.size()), prev(g.size()), seen(g.size(), 0) {}
+
+    // Length in km of the shortest path from a to b, or infinity if b
+    // cannot be reached. With path set, the graph nodes from a to b.
+    double route(uint32_t a, uint32_t b, std::vector<uint32_t>* path = nullptr) {
+        if (++generation == 0) {
+            std::fill(seen.begin(), seen.end(), 0);
+            generation = 1;
+        }
+        const Node& target = osm.nodes[g.osm_node[b]];
+        auto estimate = [&](uint32_t u) { return haversine_km(osm.nodes[g.osm_node[u]], target); };
+
+        // An entry is stale once its node is reached by a shorter path;
+        // it then no longer carries the node's distance
+        struct Entry {
+            double key; // distance plus estimate
+            double distance;
+            uint32_t node;
+            bool operator>(const Entry& o) const { return key > o.key; }
+        };
+        std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> open;
+        reach(a, 0, RoadGraph::NONE);
+        open.push({estimate(a), 0, a});
+        settled = 0;
+        while (!open.empty()) {
+            auto [key, d_u, u] = open.top();
+            open.pop();
+            if (d_u != dist[u]) continue;
+            ++settled;
+            if (u == b) break;
+            for (uint32_t e = g.first[u]; e < g.first[u + 1]; ++e) {
+                const RoadGraph::Edge& edge = g.edges[e];
+                double d = dist[u] + edge.km;
+                if (seen[edge.to] == generation && d >= dist[edge.to]) continue;
+                reach(edge.to, d, u);
+                open.push({d + estimate(edge.to), d, edge.to});
+            }
+        }
+        if (seen[b] != generation) return std::numeric_limits<double>::infinity();
+        if (path) {
+            path->clear();
+            for (uint32_t u = b; u != RoadGraph::NONE; u = prev[u]) path->push_back(u);
+            std::reverse(path->begin(), path->end());
+        }
+        return dist[b];
+    }
+
+    // Nodes settled by the last query
+    size_t last_settled() const { return settled; }
+
+private:
+    const RoadGraph& g;
+    const OsmData& osm;
+    std::vector<double> dist;
+    std::vector<uint32_t> prev;
+    std::vector<uint32_t> seen; // generation a node was last reached in
+    uint32_t generation{0};
+    size_t settled{0};
+
+    void reach(uint32_t u, double d, uint32_t from) {
+        seen[u] = generation;
+        dist[u] = d;
+        prev[u] = from;
+    }
+};
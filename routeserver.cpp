@@ -0,0 +1,270 @@
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "osm.hpp"
+#include "roadgraph.hpp"
+#include "server.hpp"
+#include "snap.hpp"
+#include "threadpool.hpp"
+
+// Routing daemon: loads the road graph once and answers shortest path
+// and snapping queries over a local socket. Each request is one line and
+// each answer one line of JSON. Requests are words or a flat JSON object:
+//
+//   route FROM TO          {"op":"route","from":FROM,"to":TO}         distance and OSM node ids of the path
+//   distance FROM TO       {"op":"distance","from":FROM,"to":TO}      distance only
+//   nearest LAT LON        {"op":"nearest","lat":LAT,"lon":LON}       closest road node
+//   snap LAT LON [LAT LON ...]  {"op":"snap","points":[[LAT,LON],...]}  closest point on a road, for each point
+//   stats                  {"op":"stats"}                             request counts and latency percentiles
+//
+// FROM and TO are OSM node ids. Errors answer {"ok":false,"error":"..."}.
+
+OsmData osm;
+RoadGraph graph;
+
+constexpr size_t MAX_LINE = 1 << 20; // room for a batch of some 20000 points
+
+// Parameters of each operation, in the order the word form takes them.
+// An operation with a list takes its parameters any number of times: in
+// the word form one after another, in the JSON form as an array of
+// arrays under that key.
+struct Operation {
+    const char* name;
+    std::vector<const char*> params;
+    const char* list = nullptr;
+};
+const Operation OPERATIONS[] = {{"route", {"from", "to"}},
+                                {"distance", {"from", "to"}},
+                                {"nearest", {"lat", "lon"}},
+                                {"snap", {"lat", "lon"}, "points"},
+                                {"stats", {}}};
+
+// Value of key in a flat JSON object: the text of a string, the inside
+// of an array, or a bare number or word. False if the key is missing.
+bool json_field(const std::string& s, const std::string& key, std::string& value) {
+    size_t at = s.find("\"" + key + "\"");
+    if (at == std::string::npos) return false;
+    at = s.find_first_not_of(" \t", at + key.size() + 2);
+    if (at == std::string::npos || s[at] != ':') return false;
+    at = s.find_first_not_of(" \t", at + 1);
+    if (at == std::string::npos) return false;
+    if (s[at] == '"') {
+        size_t end = s.find('"', at + 1);
+        if (end == std::string::npos) return false;
+        value = s.substr(at + 1, end - at - 1);
+    } else if (s[at] == '[') {
+        size_t end = at;
+        for (int depth = 0; end < s.size(); ++end) {
+            depth += s[end] == '[' ? 1 : s[end] == ']' ? -1 : 0;
+            if (depth == 0) break;
+        }
+        if (end == s.size()) return false;
+        value = s.substr(at + 1, end - at - 1);
+    } else {
+        size_t end = s.find_first_of(",} \t", at);
+        value = s.substr(at, end == std::string::npos ? std::string::npos : end - at);
+    }
+    return true;
+}
+
+std::string error(const std::string& message) {
+    std::string out = "{\"ok\":false,\"error\":\"";
+    for (char c : message) {
+        if (c == '"' || c == '\\') out += '\\';
+        out += c;
+    }
+    return out + "\"}";
+}
+
+std::string fixed(double v, int decimals) {
+    char number[32];
+    std::snprintf(number, sizeof(number), "%.*f", decimals, v);
+    return number;
+}
+
+// Whole of s as a number within [min, max]
+bool parse_number(const std::string& s, double min, double max, double& v) {
+    char* end = nullptr;
+    v = std::strtod(s.c_str(), &end);
+    return !s.empty() && *end == '\0' && v >= min && v <= max;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " <input.osm> [--port N | --socket PATH] [--threads N] [filter]\n"
+                  << "  answers route/distance queries between OSM node ids, one line each\n";
+        return 1;
+    }
+
+    const char* input_file = argv[1];
+    int port = 8081;
+    std::string socket_path;
+    unsigned threads = 0;
+    std::string filter_expr;
+
+    for (int i = 2; i < argc; ++i) {
+        std::string opt = argv[i];
+        if (opt == "--port" && i + 1 < argc) {
+            port = std::stoi(argv[++i]);
+        } else if (opt == "--socket" && i + 1 < argc) {
+            socket_path = argv[++i];
+        } else if (opt == "--threads" && i + 1 < argc) {
+            threads = std::stoul(argv[++i]);
+        } else if (opt.rfind("--", 0) != 0 && filter_expr.empty()) {
+            filter_expr = opt;
+        } else {
+            std::cerr << "Unknown option: " << opt << "\n";
+            return 1;
+        }
+    }
+
+    ThreadPool pool(threads);
+    auto t0 = std::chrono::steady_clock::now();
+    TagFilter filter(filter_expr.empty() ? "highway=*" : filter_expr, osm.tags.dict);
+    load_osm(input_file, filter, LoadMode::ReferencedNodes, osm, false);
+    graph = build_road_graph(osm);
+    RoadSnapper snapper(graph, osm);
+    std::cout << "Loaded " << graph.size() << " nodes, " << graph.edges.size() << " edges from " << osm.ways.size()
+              << " ways in " << std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count()
+              << " s\n";
+
+    server::LatencyStats latency[std::size(OPERATIONS)];
+    std::atomic<uint64_t> failed{0};
+
+    auto stats = [&] {
+        std::ostringstream out;
+        out << "{\"ok\":true,\"failed\":" << failed;
+        for (size_t i = 0; i < std::size(OPERATIONS); ++i)
+            out << ",\"" << OPERATIONS[i].name << "\":{\"count\":" << latency[i].count()
+                << ",\"p50_us\":" << latency[i].percentile_us(0.5) << ",\"p99_us\":" << latency[i].percentile_us(0.99)
+                << "}";
+        out << "}";
+        return out.str();
+    };
+
+    auto osm_id = [&](uint32_t u) { return std::to_string(osm.node_ids[graph.osm_node[u]]); };
+
+    // Nearest node, or points snapped onto roads, from lat/lon pairs
+    auto snap = [&](bool node, const std::vector<std::string>& args) -> std::string {
+        std::vector<LatLon> points(args.size() / 2);
+        for (size_t i = 0; i < points.size(); ++i)
+            if (!parse_number(args[2 * i], -90, 90, points[i].lat) ||
+                !parse_number(args[2 * i + 1], -180, 180, points[i].lon))
+                return error("bad coordinates " + args[2 * i] + " " + args[2 * i + 1]);
+
+        if (node) {
+            uint32_t u = snapper.nearest_node(points[0]);
+            if (u == RoadGraph::NONE) return error("no roads");
+            const Node& n = osm.nodes[graph.osm_node[u]];
+            double km = haversine_km({points[0].lat, points[0].lon}, n);
+            return "{\"ok\":true,\"node\":" + osm_id(u) + ",\"lat\":" + fixed(n.lat, 7) + ",\"lon\":" +
+                   fixed(n.lon, 7) + ",\"distance_km\":" + fixed(km, 6) + "}";
+        }
+        thread_local std::vector<EdgeSnap> snaps;
+        snapper.snap_all(points, snaps);
+        std::string out = "{\"ok\":true,\"snaps\":[";
+        for (size_t i = 0; i < snaps.size(); ++i) {
+            const EdgeSnap& s = snaps[i];
+            if (s.from == RoadGraph::NONE) return error("no roads");
+            out += (i ? ",{\"from\":" : "{\"from\":") + osm_id(s.from) + ",\"to\":" + osm_id(s.to) +
+                   ",\"fraction\":" + fixed(s.fraction, 6) + ",\"lat\":" + fixed(s.lat, 7) + ",\"lon\":" +
+                   fixed(s.lon, 7) + ",\"distance_km\":" + fixed(s.km, 6) + "}";
+        }
+        return out + "]}";
+    };
+
+    // Answer for operation op with its parameters in order
+    auto respond = [&](size_t op, const std::vector<std::string>& args) -> std::string {
+        std::string_view name = OPERATIONS[op].name;
+        if (name == "stats") return stats();
+        if (name == "nearest" || name == "snap") return snap(name == "nearest", args);
+        uint32_t ends[2];
+        for (int i = 0; i < 2; ++i) {
+            char* end = nullptr;
+            long long id = std::strtoll(args[i].c_str(), &end, 10);
+            if (args[i].empty() || *end != '\0')
+                return error(std::string(OPERATIONS[op].params[i]) + " must be a node id");
+            ends[i] = graph.find(osm, id);
+            if (ends[i] == RoadGraph::NONE) return error("node " + args[i] + " is not on a road");
+        }
+
+        // One searcher per worker, reused by every query it answers
+        thread_local RouteSearch search(graph, osm);
+        thread_local std::vector<uint32_t> path;
+        bool want_path = name == "route";
+        double km = search.route(ends[0], ends[1], want_path ? &path : nullptr);
+        if (std::isinf(km)) return error("no route");
+
+        std::string out = "{\"ok\":true,\"distance_km\":" + fixed(km, 6);
+        if (want_path) {
+            out += ",\"nodes\":[";
+            for (size_t i = 0; i < path.size(); ++i) {
+                if (i) out += ',';
+                out += osm_id(path[i]);
+            }
+            out += ']';
+        }
+        return out + "}";
+    };
+
+    // Split a request line into an operation and its parameters
+    auto handle_line = [&](const std::string& line) -> std::string {
+        std::string name;
+        std::vector<std::string> args;
+        size_t start = line.find_first_not_of(" \t");
+        bool json = start != std::string::npos && line[start] == '{';
+        if (json) {
+            if (!json_field(line, "op", name)) return error("op is required");
+        } else {
+            std::istringstream words(line);
+            words >> name;
+            for (std::string w; words >> w;) args.push_back(w);
+        }
+        for (size_t op = 0; op < std::size(OPERATIONS); ++op) {
+            if (name != OPERATIONS[op].name) continue;
+            const std::vector<const char*>& params = OPERATIONS[op].params;
+            const char* list = OPERATIONS[op].list;
+            if (json && list) {
+                std::string items;
+                if (!json_field(line, list, items)) return error(std::string(list) + " is required");
+                for (char& c : items)
+                    if (c == '[' || c == ']' || c == ',') c = ' ';
+                std::istringstream words(items);
+                for (std::string w; words >> w;) args.push_back(w);
+            } else if (json) {
+                for (const char* p : params)
+                    if (!json_field(line, p, args.emplace_back())) return error(std::string(p) + " is required");
+            }
+            if (list ? args.empty() || args.size() % params.size() != 0 : args.size() != params.size())
+                return error(name + " takes " + (list ? "a multiple of " : "") + std::to_string(params.size()) +
+                             " arguments");
+            auto t = std::chrono::steady_clock::now();
+            std::string answer = respond(op, args);
+            latency[op].record(std::chrono::duration<double>(std::chrono::steady_clock::now() - t).count());
+            return answer;
+        }
+        return error("unknown operation " + name);
+    };
+
+    auto handle = [&](const std::string& request) -> server::Reply {
+        std::string line = request.substr(0, request.find_last_not_of("\r\n") + 1);
+        if (line.empty()) return {};
+        std::string answer = handle_line(line);
+        if (answer.compare(0, 11, "{\"ok\":false") == 0) ++failed;
+        return {answer + "\n", nullptr, false};
+    };
+
+    int listen_fd = socket_path.empty() ? server::listen_tcp(port) : server::listen_unix(socket_path);
+    std::cout << "Serving on " << (socket_path.empty() ? "127.0.0.1:" + std::to_string(port) : socket_path) << " with "
+              << pool.size() << " workers" << std::endl;
+    server::serve(listen_fd, pool, server::line_length, handle, MAX_LINE);
+    if (!socket_path.empty()) unlink(socket_path.c_str());
+    std::cout << "Stopped, " << stats() << "\n";
+    return 0;
+}
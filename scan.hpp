@@ -0,0 +1,211 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string_view>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86 1
+#endif
+
+// Structural index for XML markup. Each 64-byte block is classified at
+// once (4x16 bytes with SSE2, 2x32 with AVX2, or a scalar loop) into bit
+// masks; quoted regions are masked out with a prefix XOR over the quote
+// bits, and the offsets of the remaining < > = and of the quotes that
+// open and close values are written to an index. Values may be quoted
+// with " or '; a block holding a ' walks its quotes in order instead, so
+// the other kind of quote inside a value is left alone. The tokenizer
+// then jumps from one structural character to the next instead of
+// testing every byte.
+//
+// The kernel is picked once at runtime from the CPU features;
+// OSM_SCAN=scalar|sse2|avx2 overrides it for comparisons.
+namespace scan {
+
+// Bytes treated as whitespace between names and attributes
+inline bool is_space(char c) {
+    return static_cast<unsigned char>(c) <= 0x20;
+}
+
+namespace detail {
+
+struct Masks {
+    uint64_t markup; // < > =
+    uint64_t dquote; // "
+    uint64_t squote; // '
+};
+
+inline Masks masks_scalar(const char* p) {
+    Masks m{0, 0, 0};
+    for (int i = 0; i < 64; ++i) {
+        char c = p[i];
+        m.markup |= uint64_t(c == '<' || c == '>' || c == '=') << i;
+        m.dquote |= uint64_t(c == '"') << i;
+        m.squote |= uint64_t(c == '\'') << i;
+    }
+    return m;
+}
+
+// Bit i set for bytes from an opening quote up to (not including) its
+// closing quote
+inline uint64_t prefix_xor(uint64_t x) {
+    x ^= x << 1;
+    x ^= x << 2;
+    x ^= x << 4;
+    x ^= x << 8;
+    x ^= x << 16;
+    x ^= x << 32;
+    return x;
+}
+
+// Bits from the open quote, or from the start of the block when a value
+// is already open, up to bit end
+inline uint64_t span(int start, int end) {
+    return (end == 64 ? ~uint64_t(0) : (uint64_t(1) << end) - 1) & ~((uint64_t(1) << start) - 1);
+}
+
+// Append the structural offsets of one block; in_string carries the
+// quote state from block to block: the quote character of the open
+// value, or 0
+inline size_t emit(Masks m, uint32_t base, uint64_t& in_string, uint32_t* out) {
+    uint64_t inside, delimiters;
+    if (m.squote == 0 && in_string != '\'') {
+        inside = prefix_xor(m.dquote) ^ (in_string ? ~uint64_t(0) : 0);
+        in_string = inside >> 63 ? '"' : 0;
+        delimiters = m.dquote;
+    } else {
+        inside = delimiters = 0;
+        int start = 0;
+        for (uint64_t q = m.dquote | m.squote; q; q &= q - 1) {
+            int bit = __builtin_ctzll(q);
+            char c = (m.dquote >> bit) & 1 ? '"' : '\'';
+            if (in_string == 0) {
+                in_string = static_cast<uint64_t>(c);
+                start = bit;
+            } else if (in_string == static_cast<uint64_t>(c)) {
+                in_string = 0;
+                inside |= span(start, bit);
+            } else {
+                continue; // the other quote, inside a value
+            }
+            delimiters |= uint64_t(1) << bit;
+        }
+        if (in_string) inside |= span(start, 64);
+    }
+    uint64_t s = (m.markup & ~inside) | delimiters;
+    size_t n = 0;
+    while (s) {
+        out[n++] = base + static_cast<uint32_t>(__builtin_ctzll(s));
+        s &= s - 1;
+    }
+    return n;
+}
+
+inline size_t index_scalar(const char* p, size_t n, uint64_t& in_string, uint32_t* out) {
+    size_t count = 0;
+    for (size_t i = 0; i < n; i += 64)
+        count += emit(masks_scalar(p + i), static_cast<uint32_t>(i), in_string, out + count);
+    return count;
+}
+
+#ifdef SCAN_X86
+
+inline Masks masks_sse2(const char* p) {
+    const __m128i lt = _mm_set1_epi8('<'), gt = _mm_set1_epi8('>');
+    const __m128i eq = _mm_set1_epi8('='), qu = _mm_set1_epi8('"'), ap = _mm_set1_epi8('\'');
+    Masks m{0, 0, 0};
+    for (int i = 0; i < 4; ++i) {
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 16 * i));
+        __m128i mk = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(b, lt), _mm_cmpeq_epi8(b, gt)),
+                                  _mm_cmpeq_epi8(b, eq));
+        m.markup |= uint64_t(static_cast<uint16_t>(_mm_movemask_epi8(mk))) << (16 * i);
+        m.dquote |= uint64_t(static_cast<uint16_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(b, qu)))) << (16 * i);
+        m.squote |= uint64_t(static_cast<uint16_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(b, ap)))) << (16 * i);
+    }
+    return m;
+}
+
+inline size_t index_sse2(const char* p, size_t n, uint64_t& in_string, uint32_t* out) {
+    size_t count = 0;
+    for (size_t i = 0; i < n; i += 64)
+        count += emit(masks_sse2(p + i), static_cast<uint32_t>(i), in_string, out + count);
+    return count;
+}
+
+__attribute__((target("avx2")))
+inline Masks masks_avx2(const char* p) {
+    const __m256i lt = _mm256_set1_epi8('<'), gt = _mm256_set1_epi8('>');
+    const __m256i eq = _mm256_set1_epi8('='), qu = _mm256_set1_epi8('"'), ap = _mm256_set1_epi8('\'');
+    __m256i b0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+    __m256i b1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + 32));
+    __m256i m0 = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(b0, lt), _mm256_cmpeq_epi8(b0, gt)),
+                                 _mm256_cmpeq_epi8(b0, eq));
+    __m256i m1 = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(b1, lt), _mm256_cmpeq_epi8(b1, gt)),
+                                 _mm256_cmpeq_epi8(b1, eq));
+    Masks m;
+    m.markup = uint32_t(_mm256_movemask_epi8(m0)) | (uint64_t(uint32_t(_mm256_movemask_epi8(m1))) << 32);
+    m.dquote = uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(b0, qu))) |
+               (uint64_t(uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(b1, qu)))) << 32);
+    m.squote = uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(b0, ap))) |
+               (uint64_t(uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(b1, ap)))) << 32);
+    return m;
+}
+
+__attribute__((target("avx2")))
+inline size_t index_avx2(const char* p, size_t n, uint64_t& in_string, uint32_t* out) {
+    size_t count = 0;
+    for (size_t i = 0; i < n; i += 64)
+        count += emit(masks_avx2(p + i), static_cast<uint32_t>(i), in_string, out + count);
+    return count;
+}
+
+#endif // SCAN_X86
+
+} // namespace detail
+
+struct Kernel {
+    const char* name;
+    // Index [p, p + n), n a multiple of 64; returns the number of offsets
+    size_t (*index)(const char* p, size_t n, uint64_t& in_string, uint32_t* out);
+};
+
+inline Kernel select_kernel() {
+    const char* force = std::getenv("OSM_SCAN");
+    std::string_view want = force ? force : "";
+    Kernel scalar{"scalar", detail::index_scalar};
+#ifdef SCAN_X86
+    Kernel sse2{"sse2", detail::index_sse2};
+    Kernel avx2{"avx2", detail::index_avx2};
+    if (want == "scalar") return scalar;
+    if (want == "sse2") return sse2;
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") ? avx2 : sse2;
+#else
+    return scalar;
+#endif
+}
+
+inline const Kernel& kernel() {
+    static const Kernel k = select_kernel();
+    return k;
+}
+
+// Offsets (relative to p) of the structural characters in [p, p + n).
+// out needs room for n entries. A partial last block is padded.
+inline size_t index_structurals(const char* p, size_t n, uint64_t& in_string, uint32_t* out) {
+    const Kernel& k = kernel();
+    size_t full = n & ~size_t(63);
+    size_t count = full ? k.index(p, full, in_string, out) : 0;
+    if (full < n) {
+        char tail[64];
+        std::memset(tail, ' ', sizeof(tail));
+        std::memcpy(tail, p + full, n - full);
+        size_t t = k.index(tail, 64, in_string, out + count);
+        for (size_t i = count; i < count + t; ++i) out[i] += static_cast<uint32_t>(full);
+        count += t;
+    }
+    return count;
+}
+
+} // namespace scan
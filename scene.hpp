@@ -0,0 +1,197 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <utility>
+#include <vector>
+#include "bmp.hpp"
+#include "osm.hpp"
+#include "projection.hpp"
+#include "render.hpp"
+#include "simplify.hpp"
+#include "spatial.hpp"
+#include "style.hpp"
+#include "threadpool.hpp"
+
+constexpr int TILE_SIZE = 256;
+
+struct TileId {
+    int z, x, y;
+};
+
+// A width x height picture of the Web Mercator world. A node at world
+// position p (pixels of the zoom 0 tile, from View::tiles(0)) lands on
+// pixel p * scale - origin.
+struct Frame {
+    double scale, ox, oy;
+    int width, height;
+
+    // Tile id, 2^z times the zoom 0 tile, so the same world positions
+    // serve every zoom
+    static Frame tile(const TileId& id) {
+        return {static_cast<double>(1 << id.z), static_cast<double>(id.x) * TILE_SIZE,
+                static_cast<double>(id.y) * TILE_SIZE, TILE_SIZE, TILE_SIZE};
+    }
+
+    // box fit into width x height as View::fit does for Mercator
+    static Frame fit(const BBox& box, int width, int height) {
+        View v = View::fit(Projection::Mercator, box, width, height);
+        return {v.sx / TILE_SIZE, v.x0 * v.sx, v.y0 * v.sy, width, height};
+    }
+
+    // What the picture shows, widened by pad pixels on every side so
+    // lines passing just outside still show where their stroke reaches
+    BBox box(double pad) const {
+        // Zoom 0 tile coordinates of the padded corners
+        auto x = [&](double px) { return (px + ox) / scale / TILE_SIZE; };
+        auto y = [&](double py) { return (py + oy) / scale / TILE_SIZE; };
+        return {tile_x_to_lon(x(-pad), 0), tile_y_to_lat(y(height + pad), 0), tile_x_to_lon(x(width + pad), 0),
+                tile_y_to_lat(y(-pad), 0)};
+    }
+
+    // Web map zoom the picture is drawn at: log2 of its size over that
+    // of the zoom 0 tile
+    double zoom() const { return std::log2(scale); }
+};
+
+// Part of a drawn way to draw: positions first..last of way_nodes
+struct Run {
+    uint32_t rank, way, first, last;
+};
+
+// Runs of the drawn ways among visible segments, which must be sorted,
+// bottom up by layer and in file order within a layer. Consecutive
+// visible segments form a run, widened to the simplified segments
+// covering it when simple is given. Runs sharing a simplified segment
+// draw it once.
+inline std::vector<Run> visible_runs(const OsmData& osm, const WayStyles& styles,
+                                     const std::vector<uint32_t>& visible, const SimplifiedWays* simple) {
+    std::vector<Run> runs;
+    uint32_t done = 0;
+    for (size_t i = 0; i < visible.size();) {
+        size_t j = i + 1;
+        while (j < visible.size() && visible[j] == visible[j - 1] + 1) ++j;
+        uint32_t w = osm.way_at(visible[i]);
+        uint32_t first = std::max(simple ? simple->prev_kept(visible[i]) : visible[i], done);
+        uint32_t last = simple ? simple->next_kept(visible[j - 1] + 1) : visible[j - 1] + 1;
+        if (first < last && styles.drawn(w)) runs.push_back({styles.layer_rank(w), w, first, last});
+        done = last;
+        i = j;
+    }
+    std::stable_sort(runs.begin(), runs.end(), [](const Run& a, const Run& b) { return a.rank < b.rank; });
+    return runs;
+}
+
+// Filled ways and multipolygons whose box meets view, so one enclosing
+// the whole view is found too; bottom up by layer, file order within
+inline std::vector<WayStyles::Area> areas_in_view(const OsmData& osm, const WayStyles& styles,
+                                                  const ClosedWayIndex& ways, const MultipolygonIndex& relations,
+                                                  const BBox& view) {
+    std::vector<uint32_t> area_ways, area_relations;
+    ways.query(view, [&](uint32_t w) { area_ways.push_back(w); });
+    relations.query(view, [&](uint32_t m) { area_relations.push_back(m); });
+    std::sort(area_ways.begin(), area_ways.end());
+    std::sort(area_relations.begin(), area_relations.end());
+    return styles.areas(osm, area_ways, area_relations);
+}
+
+// The outline of area a: point(n) for each node n of a ring and then
+// end_ring(), ring by ring. The last node of a ring repeats the first
+// and is left out, as are missing nodes and, for a way, the positions
+// simple drops when given.
+template <typename Point, typename EndRing>
+void for_each_ring_node(const OsmData& osm, const WayStyles::Area& a, const SimplifiedWays* simple, Point&& point,
+                        EndRing&& end_ring) {
+    auto ring = [&](const uint32_t* nodes, uint32_t count, const SimplifiedWays* keep, uint32_t k0) {
+        for (uint32_t i = 0; i + 1 < count; ++i)
+            if ((!keep || keep->kept(k0 + i)) && nodes[i] != NO_NODE) point(nodes[i]);
+        end_ring();
+    };
+    if (a.relation) {
+        const Multipolygon& mp = osm.multipolygons[a.index];
+        for (uint32_t r = mp.ring_begin; r < mp.ring_begin + mp.ring_count; ++r)
+            ring(osm.ring_nodes.data() + osm.rings[r].node_begin, osm.rings[r].node_count, nullptr, 0);
+    } else {
+        const Way& way = osm.ways[a.index];
+        ring(osm.way_begin(way), way.node_count, simple, way.node_begin);
+    }
+}
+
+// Loaded data made ready to draw any frame of it: styled, indexed and
+// projected once. render() only reads, so frames can be drawn on many
+// threads at once.
+class Scene {
+public:
+    Scene(OsmData& data, const StyleSheet& sheet, ThreadPool& pool)
+        : data(data), styles(style_ways(data, sheet, pool)), index(data), closed_index(data), area_index(data),
+          world(project_nodes(data.nodes, View::tiles(0), pool)) {
+        // Frames are padded by half the widest stroke, rounded up, plus a
+        // pixel, so a line just outside still draws its edge inside
+        float widest = 0;
+        for (const Style& s : styles.styles)
+            if (s.stroked) widest = std::max(widest, s.width);
+        pad = std::ceil(widest / 2) + 1;
+    }
+
+    size_t segments() const { return index.size(); }
+
+    // Pixels beyond its edges from which lines reach into a frame
+    double padding() const { return pad; }
+
+    // Draw frame f into bmp, which must be f.width x f.height. Returns
+    // false, leaving bmp untouched, when nothing is drawn in view. Areas
+    // are filled first, then the lines go on top, layers bottom up and
+    // file order within a layer.
+    bool render(const Frame& f, bool antialias, BMP& bmp) const {
+        std::vector<uint32_t> visible;
+        BBox box = f.box(pad);
+        index.query(box, [&](uint32_t k) { visible.push_back(k); });
+        std::sort(visible.begin(), visible.end());
+        std::vector<Run> runs = visible_runs(data, styles, visible, nullptr);
+        std::vector<WayStyles::Area> areas = areas_in_view(data, styles, closed_index, area_index, box);
+        if (runs.empty() && areas.empty()) return false;
+
+        const Rect clip{0, 0, f.width, f.height};
+        // Each area filled whole and once, under all the lines
+        std::vector<PolyPoint> pts;
+        std::vector<uint32_t> ring_start;
+        for (const WayStyles::Area& a : areas) {
+            pts.clear();
+            ring_start.assign(1, 0);
+            for_each_ring_node(
+                data, a, nullptr,
+                [&](uint32_t n) { pts.push_back({world[n].x * f.scale - f.ox, world[n].y * f.scale - f.oy}); },
+                [&] { ring_start.push_back(static_cast<uint32_t>(pts.size())); });
+            fill_polygon(bmp, pts.data(), ring_start.data(), ring_start.size() - 1, styles.of_area(a).fill,
+                         FillRule::EvenOdd, clip);
+        }
+
+        // Clamped so far-off ends of segments crossing a small frame stay in int range
+        auto to_px = [&](uint32_t n, int& px, int& py) {
+            const double limit = 1 << 30;
+            px = static_cast<int>(std::floor(std::clamp(world[n].x * f.scale - f.ox, -limit, limit)));
+            py = static_cast<int>(std::floor(std::clamp(world[n].y * f.scale - f.oy, -limit, limit)));
+        };
+        for (const Run& run : runs) {
+            const Style& style = styles.of(run.way);
+            if (!style.stroked) continue;
+            for (uint32_t k = run.first; k < run.last; ++k) {
+                if (data.way_nodes[k] == NO_NODE || data.way_nodes[k + 1] == NO_NODE) continue;
+                int x1, y1, x2, y2;
+                to_px(data.way_nodes[k], x1, y1);
+                to_px(data.way_nodes[k + 1], x2, y2);
+                draw_segment(bmp, Segment{x1, y1, x2, y2, style.stroke, style.width}, 0, antialias, clip);
+            }
+        }
+        return true;
+    }
+
+private:
+    const OsmData& data;
+    WayStyles styles;
+    SegmentIndex index;
+    ClosedWayIndex closed_index;
+    MultipolygonIndex area_index;
+    std::vector<ScreenPoint> world; // nodes in pixels of the zoom 0 tile
+    double pad;                     // pixels around a frame that strokes may reach into
+};
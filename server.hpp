@@ -0,0 +1,282 @@
+#pragma once
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cerrno>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "threadpool.hpp"
+
+// Plumbing shared by the daemons: a local listening socket, a loop that
+// reads requests off every connection and hands each one to a pool
+// worker, whole writes on a connection, and latency counters.
+namespace server {
+
+// Listen on 127.0.0.1:port, so only local clients can connect
+inline int listen_tcp(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) throw std::runtime_error("socket: " + std::string(std::strerror(errno)));
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(static_cast<uint16_t>(port));
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || listen(fd, 128) != 0) {
+        close(fd);
+        throw std::runtime_error("Failed to listen on port " + std::to_string(port) + ": " + std::strerror(errno));
+    }
+    return fd;
+}
+
+// Listen on a Unix socket at path, replacing a stale socket file
+inline int listen_unix(const std::string& path) {
+    sockaddr_un addr{};
+    if (path.size() >= sizeof(addr.sun_path)) throw std::runtime_error("Socket path too long: " + path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) throw std::runtime_error("socket: " + std::string(std::strerror(errno)));
+    addr.sun_family = AF_UNIX;
+    std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+    unlink(path.c_str());
+    if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || listen(fd, 128) != 0) {
+        close(fd);
+        throw std::runtime_error("Failed to listen on " + path + ": " + std::strerror(errno));
+    }
+    return fd;
+}
+
+// Write all of a and then b, in one call when the socket takes it
+inline bool send_all(int fd, std::string_view a, std::string_view b = {}) {
+    iovec iov[2] = {{const_cast<char*>(a.data()), a.size()}, {const_cast<char*>(b.data()), b.size()}};
+    msghdr msg{};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    while (iov[0].iov_len + iov[1].iov_len > 0) {
+        ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        for (iovec& v : iov) {
+            size_t used = std::min(static_cast<size_t>(n), v.iov_len);
+            v.iov_base = static_cast<char*>(v.iov_base) + used;
+            v.iov_len -= used;
+            n -= static_cast<ssize_t>(used);
+        }
+        if (iov[0].iov_len == 0) msg.msg_iov = iov + 1, msg.msg_iovlen = 1;
+    }
+    return true;
+}
+
+// Length of the first line of buffer with its "\n", or 0 if it has none
+inline size_t line_length(std::string_view buffer) {
+    size_t nl = buffer.find('\n');
+    return nl == std::string_view::npos ? 0 : nl + 1;
+}
+
+// Request latencies in a histogram of log spaced buckets, each about 9%
+// wide, from 1 us to over an hour. Recording is one atomic increment, so
+// workers never wait on each other; percentiles are read off the counts.
+class LatencyStats {
+public:
+    static constexpr int STEPS = 8; // buckets per doubling
+
+    void record(double seconds) {
+        double us = seconds * 1e6;
+        int b = us < 1 ? 0 : std::min(BUCKETS - 1, static_cast<int>(std::log2(us) * STEPS) + 1);
+        counts[b].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    uint64_t count() const {
+        uint64_t n = 0;
+        for (const auto& c : counts) n += c.load(std::memory_order_relaxed);
+        return n;
+    }
+
+    // Upper bound in microseconds of the bucket holding quantile q, or 0
+    // if nothing was recorded
+    double percentile_us(double q) const {
+        uint64_t snapshot[BUCKETS], n = 0;
+        for (int b = 0; b < BUCKETS; ++b) n += snapshot[b] = counts[b].load(std::memory_order_relaxed);
+        if (n == 0) return 0;
+        uint64_t rank = static_cast<uint64_t>(std::ceil(q * n)), seen = 0;
+        rank = std::max<uint64_t>(rank, 1);
+        for (int b = 0; b < BUCKETS; ++b)
+            if ((seen += snapshot[b]) >= rank) return std::exp2(static_cast<double>(b) / STEPS);
+        return std::exp2(static_cast<double>(BUCKETS - 1) / STEPS);
+    }
+
+private:
+    static constexpr int BUCKETS = 32 * STEPS;
+    std::atomic<uint64_t> counts[BUCKETS]{};
+};
+
+inline std::atomic<bool>& stopping() {
+    static std::atomic<bool> flag{false};
+    return flag;
+}
+
+// What a handler sends back for a request: head and then body, if any,
+// closing the connection after it when close is set
+struct Reply {
+    std::string head;
+    std::shared_ptr<const std::string> body;
+    bool close{false};
+};
+
+// Serve connections on listen_fd until SIGINT or SIGTERM. This thread
+// accepts connections and reads them as they become readable; each
+// complete request, the first frame(buffer) bytes of what a connection
+// sent, runs handle(request) on a pool worker, which sends the reply.
+// A connection has one request in hand at a time, so replies go out in
+// order, and only while it does is it on a worker: idle keep-alive
+// connections cost a buffer, not a thread. frame returns 0 for a request
+// still incomplete, which may grow to max_request bytes. A connection
+// idle for idle_seconds is closed.
+inline void serve(int listen_fd, ThreadPool& pool, const std::function<size_t(std::string_view)>& frame,
+                  const std::function<Reply(const std::string&)>& handle, size_t max_request,
+                  int idle_seconds = 30) {
+    struct sigaction sa{};
+    sa.sa_handler = [](int) { stopping() = true; };
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = 0; // no SA_RESTART, so poll() returns on a signal
+    sigaction(SIGINT, &sa, nullptr);
+    sigaction(SIGTERM, &sa, nullptr);
+    signal(SIGPIPE, SIG_IGN);
+
+    // Workers hand finished connections back through done, and wake the
+    // loop with a byte on the pipe
+    int wake[2];
+    if (pipe(wake) != 0) throw std::runtime_error("pipe: " + std::string(std::strerror(errno)));
+    fcntl(wake[0], F_SETFL, O_NONBLOCK);
+    fcntl(wake[1], F_SETFL, O_NONBLOCK);
+    std::mutex done_mutex;
+    std::vector<std::pair<int, bool>> done; // fd, whether to keep it open
+
+    using Clock = std::chrono::steady_clock;
+    struct Connection {
+        std::string buffer;
+        bool busy{false}; // a worker has its request
+        Clock::time_point last;
+    };
+    std::unordered_map<int, Connection> connections;
+
+    auto close_connection = [&](int fd) {
+        close(fd);
+        connections.erase(fd);
+    };
+    // Hand the next complete request of fd to a worker, if there is one
+    auto dispatch = [&](int fd, Connection& c) {
+        size_t n = frame(c.buffer);
+        if (n == 0) {
+            if (c.buffer.size() > max_request) close_connection(fd);
+            return;
+        }
+        c.busy = true;
+        auto request = std::make_shared<std::string>(c.buffer, 0, n);
+        c.buffer.erase(0, n);
+        pool.submit([&, fd, request] {
+            Reply r = handle(*request);
+            bool keep = !r.close;
+            if (!r.head.empty() || r.body) keep = send_all(fd, r.head, r.body ? *r.body : std::string_view()) && keep;
+            {
+                std::lock_guard<std::mutex> lock(done_mutex);
+                done.push_back({fd, keep});
+            }
+            char byte = 0;
+            (void)!write(wake[1], &byte, 1);
+        });
+    };
+
+    std::vector<pollfd> fds;
+    while (!stopping()) {
+        fds.assign({{listen_fd, POLLIN, 0}, {wake[0], POLLIN, 0}});
+        for (const auto& [fd, c] : connections)
+            if (!c.busy) fds.push_back({fd, POLLIN, 0});
+        if (poll(fds.data(), fds.size(), 1000) < 0 && errno != EINTR) break;
+        Clock::time_point now = Clock::now();
+
+        if (fds[1].revents) {
+            char bytes[256];
+            while (read(wake[0], bytes, sizeof(bytes)) > 0) {}
+            std::vector<std::pair<int, bool>> finished;
+            {
+                std::lock_guard<std::mutex> lock(done_mutex);
+                finished.swap(done);
+            }
+            for (auto [fd, keep] : finished) {
+                if (!keep) {
+                    close_connection(fd);
+                    continue;
+                }
+                Connection& c = connections[fd];
+                c.busy = false;
+                c.last = now;
+                dispatch(fd, c); // a request sent along behind the last one
+            }
+        }
+
+        for (size_t i = 2; i < fds.size(); ++i) {
+            if (!fds[i].revents) continue;
+            int fd = fds[i].fd;
+            char chunk[4096];
+            ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                close_connection(fd);
+                continue;
+            }
+            Connection& c = connections[fd];
+            c.buffer.append(chunk, static_cast<size_t>(n));
+            c.last = now;
+            dispatch(fd, c);
+        }
+
+        if (fds[0].revents) {
+            int fd = accept(listen_fd, nullptr, nullptr);
+            if (fd >= 0) {
+                // A client that stops reading cannot hold a worker for long
+                timeval timeout{idle_seconds, 0};
+                setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+                int one = 1;
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)); // fails harmlessly on Unix sockets
+                connections[fd].last = now;
+            }
+        }
+
+        for (auto it = connections.begin(); it != connections.end();) {
+            if (!it->second.busy && now - it->second.last > std::chrono::seconds(idle_seconds)) {
+                close(it->first);
+                it = connections.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+    close(listen_fd);
+    pool.wait();
+    for (const auto& [fd, c] : connections) close(fd);
+    close(wake[0]);
+    close(wake[1]);
+}
+
+} // namespace server
@@ -0,0 +1,107 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+#include "osm.hpp"
+#include "projection.hpp"
+#include "threadpool.hpp"
+
+// Douglas-Peucker simplification of way geometry in pixel space. A
+// node is dropped when the simplified line passes within tolerance
+// pixels of it, so at low zoom the runs of nodes that land on the same
+// or adjacent pixels collapse into a few long segments.
+//
+// The result is a keep flag per position of OsmData::way_nodes rather
+// than new geometry, so segment ids, way_at() and the spatial index
+// still apply. The ends of every way and the positions of missing nodes
+// (and their neighbours) are always kept.
+struct SimplifiedWays {
+    std::vector<uint8_t> keep; // keep[k] for position k of way_nodes
+
+    bool kept(uint32_t k) const { return keep[k] != 0; }
+
+    // Nearest kept position at or before k, and at or after k. Way ends
+    // are kept, so these never leave the way containing k.
+    uint32_t prev_kept(uint32_t k) const {
+        while (!keep[k]) --k;
+        return k;
+    }
+    uint32_t next_kept(uint32_t k) const {
+        while (!keep[k]) ++k;
+        return k;
+    }
+};
+
+namespace simplify_detail {
+
+// Squared distance from p to the segment a-b
+inline double segment_dist2(const ScreenPoint& p, const ScreenPoint& a, const ScreenPoint& b) {
+    double dx = b.x - a.x, dy = b.y - a.y;
+    double len2 = dx * dx + dy * dy;
+    double t = len2 > 0 ? std::clamp(((p.x - a.x) * dx + (p.y - a.y) * dy) / len2, 0.0, 1.0) : 0.0;
+    double ex = a.x + t * dx - p.x, ey = a.y + t * dy - p.y;
+    return ex * ex + ey * ey;
+}
+
+// Mark the points of pts to keep. The stack of open ranges replaces
+// recursion, so long ways cannot overflow the call stack.
+inline void douglas_peucker(const std::vector<ScreenPoint>& pts, double tolerance, uint8_t* keep,
+                            std::vector<std::pair<uint32_t, uint32_t>>& stack) {
+    uint32_t n = static_cast<uint32_t>(pts.size());
+    keep[0] = keep[n - 1] = 1;
+    double tol2 = tolerance * tolerance;
+    stack.assign(1, {0, n - 1});
+    while (!stack.empty()) {
+        auto [first, last] = stack.back();
+        stack.pop_back();
+        double worst = tol2;
+        uint32_t split = 0;
+        for (uint32_t i = first + 1; i < last; ++i) {
+            double d = segment_dist2(pts[i], pts[first], pts[last]);
+            if (d > worst) {
+                worst = d;
+                split = i;
+            }
+        }
+        if (split == 0) continue;
+        keep[split] = 1;
+        if (split - first > 1) stack.push_back({first, split});
+        if (last - split > 1) stack.push_back({split, last});
+    }
+}
+
+} // namespace simplify_detail
+
+// Simplify every way of osm to within tolerance pixels, with px the
+// projected nodes from project_nodes. Ways are split into blocks that are
+// simplified in parallel on the pool; each block writes only the flags
+// of its own ways. A tolerance of 0 or less keeps every node.
+inline SimplifiedWays simplify_ways(const OsmData& osm, const std::vector<ScreenPoint>& px, double tolerance,
+                                    ThreadPool& pool) {
+    SimplifiedWays s;
+    s.keep.assign(osm.way_nodes.size(), tolerance > 0 ? 0 : 1);
+    if (tolerance <= 0) return s;
+
+    constexpr size_t BLOCK = 1024;
+    pool.parallel_for((osm.ways.size() + BLOCK - 1) / BLOCK, [&](size_t block) {
+        std::vector<ScreenPoint> pts;
+        std::vector<std::pair<uint32_t, uint32_t>> stack;
+        size_t end = std::min(osm.ways.size(), (block + 1) * BLOCK);
+        for (size_t w = block * BLOCK; w < end; ++w) {
+            const Way& way = osm.ways[w];
+            uint32_t k = way.node_begin, last = way.node_begin + way.node_count;
+            // Runs of present nodes are simplified on their own
+            while (k < last) {
+                if (osm.way_nodes[k] == NO_NODE) {
+                    s.keep[k++] = 1;
+                    continue;
+                }
+                uint32_t run = k;
+                pts.clear();
+                for (; k < last && osm.way_nodes[k] != NO_NODE; ++k) pts.push_back(px[osm.way_nodes[k]]);
+                simplify_detail::douglas_peucker(pts, tolerance, s.keep.data() + run, stack);
+            }
+        }
+    });
+    return s;
+}
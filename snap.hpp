@@ -0,0 +1,259 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <numeric>
+#include <vector>
+#include "osm.hpp"
+#include "roadgraph.hpp"
+#include "spatial.hpp"
+
+// Static k-d tree over boxes in a plane, points being boxes of no size.
+// Items are split at the median along the wider side of their centers
+// until LEAF_SIZE remain, and every tree node keeps the box of all the
+// items under it, so a nearest search skips subtrees by box distance.
+// Nodes sit in one array in depth first order: a node's left child is
+// the next one, the right child is at right.
+class KdTree {
+public:
+    static constexpr uint32_t LEAF_SIZE = 8;
+    static constexpr uint32_t NONE = 0xffffffff;
+
+    struct Box {
+        double x0, y0, x1, y1;
+    };
+
+    void build(std::vector<Box> items) {
+        boxes = std::move(items);
+        order.resize(boxes.size());
+        std::iota(order.begin(), order.end(), 0);
+        nodes.clear();
+        if (!boxes.empty()) split(0, static_cast<uint32_t>(boxes.size()));
+    }
+
+    // Item i with the smallest dist(i), a squared distance from (x, y),
+    // or found unchanged if none beats best. best and found may start
+    // from a known item, to prune with its distance from the outset.
+    template <typename Dist>
+    void nearest(double x, double y, Dist&& dist, double& best, uint32_t& found) const {
+        if (!nodes.empty()) search(0, x, y, dist, best, found);
+    }
+
+private:
+    struct TreeNode {
+        Box box;
+        uint32_t begin, end; // slice of order
+        uint32_t right;      // 0 for a leaf
+    };
+
+    std::vector<Box> boxes;
+    std::vector<uint32_t> order; // item ids, grouped by leaf
+    std::vector<TreeNode> nodes;
+
+    void split(uint32_t begin, uint32_t end) {
+        Box b = boxes[order[begin]];
+        for (uint32_t i = begin + 1; i < end; ++i) {
+            const Box& o = boxes[order[i]];
+            b = {std::min(b.x0, o.x0), std::min(b.y0, o.y0), std::max(b.x1, o.x1), std::max(b.y1, o.y1)};
+        }
+        size_t n = nodes.size();
+        nodes.push_back({b, begin, end, 0});
+        if (end - begin <= LEAF_SIZE) return;
+
+        bool along_x = b.x1 - b.x0 >= b.y1 - b.y0;
+        auto center = [&](uint32_t i) {
+            return along_x ? boxes[i].x0 + boxes[i].x1 : boxes[i].y0 + boxes[i].y1;
+        };
+        uint32_t mid = begin + (end - begin) / 2;
+        std::nth_element(order.begin() + begin, order.begin() + mid, order.begin() + end,
+                         [&](uint32_t a, uint32_t c) { return center(a) < center(c); });
+        split(begin, mid);
+        nodes[n].right = static_cast<uint32_t>(nodes.size());
+        split(mid, end);
+    }
+
+    static double box_distance(const Box& b, double x, double y) {
+        double dx = std::max({b.x0 - x, 0.0, x - b.x1});
+        double dy = std::max({b.y0 - y, 0.0, y - b.y1});
+        return dx * dx + dy * dy;
+    }
+
+    template <typename Dist>
+    void search(uint32_t n, double x, double y, Dist& dist, double& best, uint32_t& found) const {
+        const TreeNode& node = nodes[n];
+        if (node.right == 0) {
+            for (uint32_t i = node.begin; i < node.end; ++i) {
+                double d = dist(order[i]);
+                if (d < best) best = d, found = order[i];
+            }
+            return;
+        }
+        // Nearer child first, so the farther one is more often pruned
+        uint32_t a = n + 1, b = node.right;
+        double da = box_distance(nodes[a].box, x, y), db = box_distance(nodes[b].box, x, y);
+        if (db < da) std::swap(a, b), std::swap(da, db);
+        if (da < best) search(a, x, y, dist, best, found);
+        if (db < best) search(b, x, y, dist, best, found);
+    }
+};
+
+struct LatLon {
+    double lat, lon;
+};
+
+// Point on a road closest to a query: fraction of the way from graph
+// node from to graph node to, at lat/lon, km from the query
+struct EdgeSnap {
+    uint32_t from{RoadGraph::NONE}, to{RoadGraph::NONE};
+    uint32_t way{0};
+    double fraction{0};
+    double lat{0}, lon{0};
+    double km{0};
+};
+
+// Snaps coordinates onto a RoadGraph: the nearest graph node, or the
+// nearest point on any road segment. Searches run in a plane around the
+// middle latitude of the data (km east and north), which is exact enough
+// for picking the nearest road of a city or region; the reported
+// distance is the great circle one.
+class RoadSnapper {
+public:
+    RoadSnapper(const RoadGraph& g, const OsmData& osm) : g(g), osm(osm) {
+        double min_lat = 90, max_lat = -90;
+        for (uint32_t n : g.osm_node) {
+            min_lat = std::min(min_lat, osm.nodes[n].lat);
+            max_lat = std::max(max_lat, osm.nodes[n].lat);
+        }
+        ky = EARTH_RADIUS_KM * M_PI / 180;
+        kx = g.size() ? ky * std::cos((min_lat + max_lat) / 2 * M_PI / 180) : ky;
+
+        std::vector<KdTree::Box> points(g.size());
+        xy.resize(g.size());
+        for (uint32_t u = 0; u < g.size(); ++u) {
+            xy[u] = plane(osm.nodes[g.osm_node[u]]);
+            points[u] = {xy[u].x, xy[u].y, xy[u].x, xy[u].y};
+        }
+        node_tree.build(std::move(points));
+
+        // Each road segment once, though two way streets have an edge
+        // each way
+        std::vector<KdTree::Box> boxes;
+        for (uint32_t u = 0; u < g.size(); ++u) {
+            for (uint32_t e = g.first[u]; e < g.first[u + 1]; ++e) {
+                uint32_t v = g.edges[e].to;
+                if (v < u && has_edge(v, u)) continue;
+                segments.push_back({u, v, g.edges[e].way});
+                boxes.push_back({std::min(xy[u].x, xy[v].x), std::min(xy[u].y, xy[v].y),
+                                 std::max(xy[u].x, xy[v].x), std::max(xy[u].y, xy[v].y)});
+            }
+        }
+        segment_tree.build(std::move(boxes));
+    }
+
+    // Graph node closest to p, or RoadGraph::NONE for an empty graph
+    uint32_t nearest_node(const LatLon& p) const {
+        Point q = plane({p.lat, p.lon});
+        double best = std::numeric_limits<double>::infinity();
+        uint32_t found = KdTree::NONE;
+        node_tree.nearest(q.x, q.y, [&](uint32_t u) { return squared(xy[u], q); }, best, found);
+        return found == KdTree::NONE ? RoadGraph::NONE : found;
+    }
+
+    // Point on a road segment closest to p; from is NONE for a graph
+    // without edges
+    EdgeSnap nearest_edge(const LatLon& p) const { return snap_to(nearest_segment(p, KdTree::NONE), p); }
+
+    // Snap each of points onto the roads, out[i] for points[i]. Points
+    // are taken in Hilbert curve order and each search starts out bounded
+    // by the segment the previous point snapped to, so a batch of nearby
+    // points prunes most of the tree from the first step.
+    void snap_all(const std::vector<LatLon>& points, std::vector<EdgeSnap>& out) const {
+        out.assign(points.size(), EdgeSnap{});
+        if (points.empty()) return;
+        BBox ext{points[0].lon, points[0].lat, points[0].lon, points[0].lat};
+        for (const LatLon& p : points) {
+            ext.min_lon = std::min(ext.min_lon, p.lon), ext.max_lon = std::max(ext.max_lon, p.lon);
+            ext.min_lat = std::min(ext.min_lat, p.lat), ext.max_lat = std::max(ext.max_lat, p.lat);
+        }
+        double w = std::max(ext.max_lon - ext.min_lon, 1e-12), h = std::max(ext.max_lat - ext.min_lat, 1e-12);
+        std::vector<std::pair<uint64_t, uint32_t>> visit(points.size());
+        for (uint32_t i = 0; i < points.size(); ++i)
+            visit[i] = {hilbert(static_cast<uint32_t>((points[i].lon - ext.min_lon) / w * 65535),
+                                static_cast<uint32_t>((points[i].lat - ext.min_lat) / h * 65535)),
+                        i};
+        std::sort(visit.begin(), visit.end());
+
+        uint32_t previous = KdTree::NONE;
+        for (auto [key, i] : visit) {
+            previous = nearest_segment(points[i], previous);
+            out[i] = snap_to(previous, points[i]);
+        }
+    }
+
+private:
+    struct Point {
+        double x, y;
+    };
+    struct Segment {
+        uint32_t a, b, way;
+    };
+
+    const RoadGraph& g;
+    const OsmData& osm;
+    double kx, ky; // km per degree of longitude and latitude
+    std::vector<Point> xy; // graph nodes in the plane
+    std::vector<Segment> segments;
+    KdTree node_tree, segment_tree;
+
+    Point plane(const Node& n) const { return {n.lon * kx, n.lat * ky}; }
+
+    static double squared(const Point& a, const Point& b) {
+        return (a.x - b.x) * (a.x - b.x) + (a.y - b.y) * (a.y - b.y);
+    }
+
+    bool has_edge(uint32_t u, uint32_t v) const {
+        for (uint32_t e = g.first[u]; e < g.first[u + 1]; ++e)
+            if (g.edges[e].to == v) return true;
+        return false;
+    }
+
+    // Fraction of the way along segment s closest to q
+    double project(const Segment& s, const Point& q) const {
+        const Point &a = xy[s.a], &b = xy[s.b];
+        double dx = b.x - a.x, dy = b.y - a.y, len2 = dx * dx + dy * dy;
+        if (len2 == 0) return 0;
+        return std::clamp(((q.x - a.x) * dx + (q.y - a.y) * dy) / len2, 0.0, 1.0);
+    }
+
+    double segment_distance(uint32_t k, const Point& q) const {
+        const Segment& s = segments[k];
+        double t = project(s, q);
+        const Point &a = xy[s.a], &b = xy[s.b];
+        return squared({a.x + (b.x - a.x) * t, a.y + (b.y - a.y) * t}, q);
+    }
+
+    // Segment closest to p, searching from segment hint when there is one
+    uint32_t nearest_segment(const LatLon& p, uint32_t hint) const {
+        Point q = plane({p.lat, p.lon});
+        double best = std::numeric_limits<double>::infinity();
+        uint32_t found = hint;
+        if (hint != KdTree::NONE) best = segment_distance(hint, q);
+        segment_tree.nearest(q.x, q.y, [&](uint32_t k) { return segment_distance(k, q); }, best, found);
+        return found;
+    }
+
+    EdgeSnap snap_to(uint32_t k, const LatLon& p) const {
+        EdgeSnap snap;
+        if (k == KdTree::NONE) return snap;
+        Point q = plane({p.lat, p.lon});
+        const Segment& s = segments[k];
+        const Node &a = osm.nodes[g.osm_node[s.a]], &b = osm.nodes[g.osm_node[s.b]];
+        snap.from = s.a, snap.to = s.b, snap.way = s.way;
+        snap.fraction = project(s, q);
+        snap.lat = a.lat + (b.lat - a.lat) * snap.fraction;
+        snap.lon = a.lon + (b.lon - a.lon) * snap.fraction;
+        snap.km = haversine_km({p.lat, p.lon}, {snap.lat, snap.lon});
+        return snap;
+    }
+};
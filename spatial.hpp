@@ -0,0 +1,236 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "osm.hpp"
+
+// Axis aligned box in degrees
+struct BBox {
+    double min_lon, min_lat, max_lon, max_lat;
+
+    bool intersects(const BBox& o) const {
+        return min_lon <= o.max_lon && o.min_lon <= max_lon && min_lat <= o.max_lat && o.min_lat <= max_lat;
+    }
+};
+
+// "min_lon,min_lat,max_lon,max_lat"
+inline BBox parse_bbox(const std::string& s) {
+    BBox b;
+    if (std::sscanf(s.c_str(), "%lf,%lf,%lf,%lf", &b.min_lon, &b.min_lat, &b.max_lon, &b.max_lat) != 4 ||
+        b.min_lon >= b.max_lon || b.min_lat >= b.max_lat)
+        throw std::runtime_error("Invalid bbox '" + s + "', expected min_lon,min_lat,max_lon,max_lat");
+    return b;
+}
+
+// Area shown by a width x height image centered on lat/lon at a web map
+// zoom level (256 px tiles, so zoom z spans 360 / 2^z degrees per tile).
+// The latitude span is narrowed by cos(lat) to keep the aspect right.
+inline BBox bbox_around(double lat, double lon, double zoom, int width, int height) {
+    double lon_span = 360.0 / std::pow(2.0, zoom) * width / 256.0;
+    double lat_span = lon_span * std::cos(lat * M_PI / 180.0) * height / width;
+    return {lon - lon_span / 2, lat - lat_span / 2, lon + lon_span / 2, lat + lat_span / 2};
+}
+
+// Position of (x, y) on a 2^16 x 2^16 Hilbert curve
+inline uint64_t hilbert(uint32_t x, uint32_t y) {
+    uint64_t d = 0;
+    for (uint32_t s = 1u << 15; s > 0; s >>= 1) {
+        uint32_t rx = (x & s) > 0;
+        uint32_t ry = (y & s) > 0;
+        d += uint64_t(s) * s * ((3 * rx) ^ ry);
+        if (ry == 0) {
+            if (rx == 1) {
+                x = 0xFFFF - x;
+                y = 0xFFFF - y;
+            }
+            std::swap(x, y);
+        }
+    }
+    return d;
+}
+
+// Static packed R-tree: items are sorted along a Hilbert curve and
+// packed into nodes of NODE_SIZE, built bottom up in one flat array.
+class PackedRTree {
+public:
+    static constexpr size_t NODE_SIZE = 16;
+
+    void build(std::vector<BBox> items, std::vector<uint32_t> ids) {
+        boxes.clear();
+        refs.clear();
+        level_end.clear();
+        if (items.empty()) return;
+
+        BBox ext = items[0];
+        for (const BBox& b : items) {
+            ext.min_lon = std::min(ext.min_lon, b.min_lon);
+            ext.min_lat = std::min(ext.min_lat, b.min_lat);
+            ext.max_lon = std::max(ext.max_lon, b.max_lon);
+            ext.max_lat = std::max(ext.max_lat, b.max_lat);
+        }
+        double w = std::max(ext.max_lon - ext.min_lon, 1e-12), h = std::max(ext.max_lat - ext.min_lat, 1e-12);
+        std::vector<uint64_t> keys(items.size());
+        for (size_t i = 0; i < items.size(); ++i) {
+            double cx = (items[i].min_lon + items[i].max_lon) / 2, cy = (items[i].min_lat + items[i].max_lat) / 2;
+            keys[i] = hilbert(static_cast<uint32_t>((cx - ext.min_lon) / w * 65535),
+                              static_cast<uint32_t>((cy - ext.min_lat) / h * 65535));
+        }
+        std::vector<uint32_t> order(items.size());
+        std::iota(order.begin(), order.end(), 0);
+        std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return keys[a] < keys[b]; });
+
+        for (uint32_t i : order) {
+            boxes.push_back(items[i]);
+            refs.push_back(ids[i]);
+        }
+        level_end.push_back(boxes.size());
+
+        // Each parent covers NODE_SIZE consecutive boxes of the level below
+        size_t begin = 0;
+        while (level_end.back() - begin > 1) {
+            size_t end = level_end.back();
+            for (size_t i = begin; i < end; i += NODE_SIZE) {
+                BBox b = boxes[i];
+                for (size_t j = i + 1; j < std::min(end, i + NODE_SIZE); ++j) {
+                    b.min_lon = std::min(b.min_lon, boxes[j].min_lon);
+                    b.min_lat = std::min(b.min_lat, boxes[j].min_lat);
+                    b.max_lon = std::max(b.max_lon, boxes[j].max_lon);
+                    b.max_lat = std::max(b.max_lat, boxes[j].max_lat);
+                }
+                boxes.push_back(b);
+                refs.push_back(static_cast<uint32_t>(i));
+            }
+            begin = end;
+            level_end.push_back(boxes.size());
+        }
+    }
+
+    // Calls fn(id) for every item whose box intersects q
+    template <typename F>
+    void query(const BBox& q, F&& fn) const {
+        if (boxes.empty()) return;
+        struct Entry { size_t pos; size_t level; };
+        std::vector<Entry> stack{{boxes.size() - 1, level_end.size() - 1}};
+        while (!stack.empty()) {
+            Entry e = stack.back();
+            stack.pop_back();
+            if (!boxes[e.pos].intersects(q)) continue;
+            if (e.level == 0) {
+                fn(refs[e.pos]);
+                continue;
+            }
+            size_t first = refs[e.pos];
+            size_t last = std::min(first + NODE_SIZE, level_end[e.level - 1]);
+            for (size_t c = last; c-- > first;) stack.push_back({c, e.level - 1});
+        }
+    }
+
+    size_t size() const { return level_end.empty() ? 0 : level_end[0]; }
+
+private:
+    std::vector<BBox> boxes;        // leaves first, then each level up to the root
+    std::vector<uint32_t> refs;     // leaf: item id, inner node: first child
+    std::vector<size_t> level_end;  // end of each level in boxes
+};
+
+// R-tree over the way segments of an OsmData. Segment k joins
+// way_nodes[k] and way_nodes[k + 1] of the same way.
+class SegmentIndex {
+public:
+    explicit SegmentIndex(const OsmData& osm) {
+        std::vector<BBox> boxes;
+        std::vector<uint32_t> ids;
+        for (const Way& way : osm.ways) {
+            for (uint32_t k = way.node_begin; k + 1 < way.node_begin + way.node_count; ++k) {
+                uint32_t a = osm.way_nodes[k], b = osm.way_nodes[k + 1];
+                if (a == NO_NODE || b == NO_NODE) continue;
+                const Node& n1 = osm.nodes[a];
+                const Node& n2 = osm.nodes[b];
+                boxes.push_back({std::min(n1.lon, n2.lon), std::min(n1.lat, n2.lat),
+                                 std::max(n1.lon, n2.lon), std::max(n1.lat, n2.lat)});
+                ids.push_back(k);
+            }
+        }
+        tree.build(std::move(boxes), std::move(ids));
+    }
+
+    // Calls fn(k) for every segment whose box intersects q
+    template <typename F>
+    void query(const BBox& q, F&& fn) const { tree.query(q, std::forward<F>(fn)); }
+
+    size_t size() const { return tree.size(); }
+
+private:
+    PackedRTree tree;
+};
+
+// R-tree over the closed ways of an OsmData, by the box of their nodes,
+// so an area is found for a view that lies wholly inside it, where none
+// of its segments are in view
+class ClosedWayIndex {
+public:
+    explicit ClosedWayIndex(const OsmData& osm) {
+        std::vector<BBox> boxes;
+        std::vector<uint32_t> ids;
+        for (uint32_t w = 0; w < osm.ways.size(); ++w) {
+            const Way& way = osm.ways[w];
+            if (!osm.closed(way)) continue;
+            BBox b{1e9, 1e9, -1e9, -1e9};
+            for (const uint32_t* n = osm.way_begin(way); n != osm.way_end(way); ++n) {
+                if (*n == NO_NODE) continue;
+                b.min_lon = std::min(b.min_lon, osm.nodes[*n].lon), b.max_lon = std::max(b.max_lon, osm.nodes[*n].lon);
+                b.min_lat = std::min(b.min_lat, osm.nodes[*n].lat), b.max_lat = std::max(b.max_lat, osm.nodes[*n].lat);
+            }
+            boxes.push_back(b);
+            ids.push_back(w);
+        }
+        tree.build(std::move(boxes), std::move(ids));
+    }
+
+    // Calls fn(w) for every closed way whose box intersects q
+    template <typename F>
+    void query(const BBox& q, F&& fn) const { tree.query(q, std::forward<F>(fn)); }
+
+    size_t size() const { return tree.size(); }
+
+private:
+    PackedRTree tree;
+};
+
+// R-tree over the multipolygons of an OsmData, by the box of their rings
+class MultipolygonIndex {
+public:
+    explicit MultipolygonIndex(const OsmData& osm) {
+        std::vector<BBox> boxes;
+        std::vector<uint32_t> ids;
+        for (uint32_t m = 0; m < osm.multipolygons.size(); ++m) {
+            const Multipolygon& mp = osm.multipolygons[m];
+            BBox b{1e9, 1e9, -1e9, -1e9};
+            for (uint32_t r = mp.ring_begin; r < mp.ring_begin + mp.ring_count; ++r) {
+                for (uint32_t k = osm.rings[r].node_begin; k < osm.rings[r].node_begin + osm.rings[r].node_count; ++k) {
+                    if (osm.ring_nodes[k] == NO_NODE) continue;
+                    const Node& n = osm.nodes[osm.ring_nodes[k]];
+                    b.min_lon = std::min(b.min_lon, n.lon), b.max_lon = std::max(b.max_lon, n.lon);
+                    b.min_lat = std::min(b.min_lat, n.lat), b.max_lat = std::max(b.max_lat, n.lat);
+                }
+            }
+            if (b.min_lon > b.max_lon) continue;
+            boxes.push_back(b);
+            ids.push_back(m);
+        }
+        tree.build(std::move(boxes), std::move(ids));
+    }
+
+    // Calls fn(m) for every multipolygon whose box intersects q
+    template <typename F>
+    void query(const BBox& q, F&& fn) const { tree.query(q, std::forward<F>(fn)); }
+
+    size_t size() const { return tree.size(); }
+
+private:
+    PackedRTree tree;
+};
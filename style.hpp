@@ -0,0 +1,227 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "color.h"
+#include "filter.hpp"
+#include "osm.hpp"
+#include "threadpool.hpp"
+
+// Style rules: each maps ways matching a TagFilter expression to a
+// layer, a stroke color and a width, and optionally a fill color for the
+// closed ones. The first matching rule wins.
+// Rules are evaluated once per way into a small style id, and the ways
+// are grouped by layer, so a renderer sweeps the layers bottom up and
+// never looks at tags per segment. Multipolygon relations are matched
+// against the same rules and take the fill of theirs.
+//
+// A style sheet has one rule per line; lines starting with '#' are
+// comments:
+//
+//   layer  color            width  filter
+//   50     #ff0000          5      highway=primary
+//   5      #b0a090/#d9d0c9  1      building
+//   0      none             1      barrier
+//
+// The filter is the rest of the line and may be empty to match every
+// way. The color is the stroke, then after a slash the fill of closed
+// ways; open ways only get the stroke. Color none hides the ways a rule
+// matches, and a stroke of none with a fill draws just the fill. Ways no
+// rule matches are not drawn.
+
+struct Style {
+    int layer{0};
+    color stroke;
+    float width{1};
+    bool stroked{true};
+    color fill;
+    bool filled{false};
+
+    bool drawn() const { return stroked || filled; }
+};
+
+struct StyleRule {
+    Style style;
+    std::string filter;
+};
+
+// Red roads over black everything else, widths by road class, on
+// filled buildings, water and green areas
+inline constexpr std::string_view DEFAULT_STYLE = R"(# layer  color            width  filter
+70  #ff0000          7    highway=motorway
+65  #ff0000          4.9  highway=motorway_link
+60  #ff0000          6    highway=trunk
+55  #ff0000          4.2  highway=trunk_link
+50  #ff0000          5    highway=primary
+45  #ff0000          3.5  highway=primary_link
+40  #ff0000          4    highway=secondary
+35  #ff0000          2.8  highway=secondary_link
+30  #ff0000          3    highway=tertiary
+25  #ff0000          2.1  highway=tertiary_link
+20  #ff0000          2.5  highway=residential|unclassified|living_street
+10  #ff0000          1.5  highway=service|road
+10  #ff0000          1    highway
+0   #000000/#d9d0c9  1    building
+0   #000000/#aad3df  1    natural=water or waterway=riverbank or landuse=reservoir|basin
+0   #000000/#c8facc  1    leisure=park|garden|pitch or landuse=grass|meadow|recreation_ground|forest or natural=wood
+0   #000000          1
+)";
+
+class StyleSheet {
+public:
+    std::vector<StyleRule> rules;
+
+    static StyleSheet parse(std::string_view text) {
+        StyleSheet sheet;
+        std::istringstream in{std::string(text)};
+        std::string line;
+        for (int n = 1; std::getline(in, line); ++n) {
+            size_t first = line.find_first_not_of(" \t\r");
+            if (first == std::string::npos || line[first] == '#') continue;
+            std::istringstream fields(line);
+            StyleRule rule;
+            std::string clr;
+            if (!(fields >> rule.style.layer >> clr >> rule.style.width) || !parse_color(clr, rule.style))
+                throw std::runtime_error("Style line " + std::to_string(n) + ": expected layer color width [filter]");
+            std::getline(fields, rule.filter);
+            sheet.rules.push_back(std::move(rule));
+        }
+        return sheet;
+    }
+
+    static StyleSheet load(const std::string& file) {
+        std::ifstream in(file);
+        if (!in) throw std::runtime_error("Failed to open style " + file);
+        std::stringstream text;
+        text << in.rdbuf();
+        return parse(text.str());
+    }
+
+    static StyleSheet defaults() { return parse(DEFAULT_STYLE); }
+
+private:
+    // stroke[/fill], each #rrggbb or none
+    static bool parse_color(const std::string& s, Style& style) {
+        size_t slash = s.find('/');
+        if (slash == std::string::npos) return parse_color(s, style.stroke, style.stroked);
+        return parse_color(s.substr(0, slash), style.stroke, style.stroked) &&
+               parse_color(s.substr(slash + 1), style.fill, style.filled);
+    }
+
+    static bool parse_color(const std::string& s, color& c, bool& used) {
+        used = s != "none";
+        if (!used) return true;
+        unsigned r, g, b;
+        if (s.size() != 7 || std::sscanf(s.c_str(), "#%2x%2x%2x", &r, &g, &b) != 3) return false;
+        c = color(r, g, b);
+        return true;
+    }
+};
+
+// Style id of every way, and the drawn ways grouped by layer
+struct WayStyles {
+    static constexpr uint16_t NONE = 0xffff; // not drawn
+
+    std::vector<Style> styles;      // by style id, one per rule
+    std::vector<uint16_t> way_style; // per way, or NONE
+    std::vector<int> layers;         // distinct layers of drawn styles, ascending
+    std::vector<uint32_t> rank;      // by style id, position of its layer in layers
+    std::vector<uint32_t> start;     // layers[i] owns order[start[i], start[i + 1])
+    std::vector<uint32_t> order;     // way indexes, file order within a layer
+    std::vector<uint16_t> area_style; // per multipolygon, NONE unless its style fills it
+
+    bool drawn(uint32_t w) const { return way_style[w] != NONE; }
+    const Style& of(uint32_t w) const { return styles[way_style[w]]; }
+
+    // Whether drawn way w has its stroke drawn, and is filled
+    bool stroked(uint32_t w) const { return of(w).stroked; }
+    bool filled(const OsmData& osm, uint32_t w) const { return of(w).filled && osm.closed(osm.ways[w]); }
+
+    // Position of drawn way w's layer, for ordering segments by layer
+    uint32_t layer_rank(uint32_t w) const { return rank[way_style[w]]; }
+
+    // A filled closed way or multipolygon, with its layer position
+    struct Area {
+        uint32_t rank;
+        uint32_t index; // of a way, or of a multipolygon if relation
+        bool relation;
+    };
+
+    // The filled ones of the ways and multipolygons given, bottom up by
+    // layer and in the given order within a layer
+    std::vector<Area> areas(const OsmData& osm, const std::vector<uint32_t>& ways,
+                            const std::vector<uint32_t>& multipolygons) const {
+        std::vector<Area> out;
+        for (uint32_t w : ways)
+            if (drawn(w) && filled(osm, w)) out.push_back({layer_rank(w), w, false});
+        for (uint32_t m : multipolygons)
+            if (area_style[m] != NONE) out.push_back({rank[area_style[m]], m, true});
+        std::stable_sort(out.begin(), out.end(), [](const Area& a, const Area& b) { return a.rank < b.rank; });
+        return out;
+    }
+
+    const Style& of_area(const Area& a) const { return styles[a.relation ? area_style[a.index] : way_style[a.index]]; }
+};
+
+// Match every way and multipolygon of osm against sheet, in parallel on
+// the pool. The filters are compiled into osm's tag dictionary first.
+inline WayStyles style_ways(OsmData& osm, const StyleSheet& sheet, ThreadPool& pool) {
+    if (sheet.rules.size() >= WayStyles::NONE) throw std::runtime_error("Too many style rules");
+    WayStyles ws;
+    std::vector<TagFilter> filters;
+    for (const StyleRule& rule : sheet.rules) {
+        ws.styles.push_back(rule.style);
+        filters.emplace_back(rule.filter, osm.tags.dict);
+    }
+
+    ws.way_style.assign(osm.ways.size(), WayStyles::NONE);
+    constexpr size_t BLOCK = 4096;
+    pool.parallel_for((osm.ways.size() + BLOCK - 1) / BLOCK, [&](size_t b) {
+        size_t end = std::min(osm.ways.size(), (b + 1) * BLOCK);
+        for (size_t w = b * BLOCK; w < end; ++w) {
+            for (size_t r = 0; r < filters.size(); ++r) {
+                if (!filters[r].match(osm.tags, osm.ways[w].tags)) continue;
+                if (ws.styles[r].drawn()) ws.way_style[w] = static_cast<uint16_t>(r);
+                break;
+            }
+        }
+    });
+
+    // Multipolygons are only ever filled
+    ws.area_style.assign(osm.multipolygons.size(), WayStyles::NONE);
+    pool.parallel_for((osm.multipolygons.size() + BLOCK - 1) / BLOCK, [&](size_t b) {
+        size_t end = std::min(osm.multipolygons.size(), (b + 1) * BLOCK);
+        for (size_t m = b * BLOCK; m < end; ++m) {
+            for (size_t r = 0; r < filters.size(); ++r) {
+                if (!filters[r].match(osm.tags, osm.multipolygons[m].tags)) continue;
+                if (ws.styles[r].filled) ws.area_style[m] = static_cast<uint16_t>(r);
+                break;
+            }
+        }
+    });
+
+    // Counting sort of the drawn ways by layer keeps file order in a layer
+    for (const Style& s : ws.styles)
+        if (s.drawn()) ws.layers.push_back(s.layer);
+    std::sort(ws.layers.begin(), ws.layers.end());
+    ws.layers.erase(std::unique(ws.layers.begin(), ws.layers.end()), ws.layers.end());
+    ws.rank.resize(ws.styles.size());
+    for (size_t r = 0; r < ws.styles.size(); ++r)
+        ws.rank[r] = static_cast<uint32_t>(
+            std::lower_bound(ws.layers.begin(), ws.layers.end(), ws.styles[r].layer) - ws.layers.begin());
+    ws.start.assign(ws.layers.size() + 1, 0);
+    for (uint16_t s : ws.way_style)
+        if (s != WayStyles::NONE) ++ws.start[ws.rank[s] + 1];
+    for (size_t i = 0; i < ws.layers.size(); ++i) ws.start[i + 1] += ws.start[i];
+    ws.order.resize(ws.start.back());
+    std::vector<uint32_t> fill(ws.start.begin(), ws.start.end() - 1);
+    for (uint32_t w = 0; w < osm.ways.size(); ++w)
+        if (ws.drawn(w)) ws.order[fill[ws.layer_rank(w)]++] = w;
+    return ws;
+}
@@ -1,44 +1,193 @@
+#include <charconv>
+#include <cstring>
 #include <fstream>
+#include <sstream>
 #include <string>
+#include <string_view>
+#include <vector>
 #include  "color.h"
 class svg {
+public:
+    struct point {
+        int x, y;
+    };
+
 private:
+    // Output goes through one reusable buffer written out in large blocks;
+    // numbers are formatted straight into it with std::to_chars
+    static constexpr size_t BUFFER_SIZE = 1 << 20;
+
     std::ofstream svgFile;
+    std::vector<char> buffer;
+    size_t used{0};
+
+    // Styles are formatted once: the tail of a <line> for each stroke
+    // color seen, and the start of a <path> for each class
+    struct LineStyle {
+        color clr;
+        std::string text;
+    };
+    std::vector<LineStyle> lineStyles;
+    std::vector<std::string> pathPrefixes;
+
+    const std::string& lineStyle(const color& clr) {
+        for (const LineStyle& s : lineStyles)
+            if (s.clr.r == clr.r && s.clr.g == clr.g && s.clr.b == clr.b) return s.text;
+        lineStyles.push_back({clr, "\" stroke=\"" + clr.tostr() + "\" stroke-width=\"2\" />\n"});
+        return lineStyles.back().text;
+    }
+
+    void flushBuffer() {
+        svgFile.write(buffer.data(), used);
+        used = 0;
+    }
+
+    // Pointer to room for n more bytes
+    char* reserve(size_t n) {
+        if (used + n > buffer.size()) {
+            flushBuffer();
+            if (n > buffer.size()) buffer.resize(n);
+        }
+        return buffer.data() + used;
+    }
+
+    void append(std::string_view s) {
+        std::memcpy(reserve(s.size()), s.data(), s.size());
+        used += s.size();
+    }
+
+    void append(char c) {
+        *reserve(1) = c;
+        ++used;
+    }
+
+    void append(int n) {
+        char* p = reserve(12);
+        used = std::to_chars(p, p + 12, n).ptr - buffer.data();
+    }
+
+    // Append n to a path, with a space only where the sign does not
+    // already separate it from the previous number
+    void pathNumber(int n, bool first) {
+        if (!first && n >= 0) append(' ');
+        append(n);
+    }
 
     // Private helper to write line to the SVG file
-    void drawLineInternal(int x1, int y1, int x2, int y2, const std::string& color) {
-        
-        svgFile << "<line x1=\"" << x1 << "\" y1=\"" << y1
-                << "\" x2=\"" << x2 << "\" y2=\"" << y2
-                << "\" stroke=\"" << color << "\" stroke-width=\"2\" />\n";
+    void drawLineInternal(int x1, int y1, int x2, int y2, std::string_view style) {
+        append("<line x1=\"");
+        append(x1);
+        append("\" y1=\"");
+        append(y1);
+        append("\" x2=\"");
+        append(x2);
+        append("\" y2=\"");
+        append(y2);
+        append(style);
     }
 
 public:
     // Constructor: Open SVG file, write header
-    svg(const std::string& filename, int width = 500, int height = 500) {
-        svgFile.open(filename);
+    svg(const std::string& filename, int width = 500, int height = 500) : buffer(BUFFER_SIZE) {
+        svgFile.open(filename, std::ios::binary);
         if (!svgFile.is_open()) {
             throw std::runtime_error("Failed to open SVG file.");
         }
 
         // Write SVG header
-        svgFile << "<?xml version=\"1.0\" standalone=\"no\"?>\n";
-        svgFile << "<!DOCTYPE svg PUBLIC \"-//W3C//DTD SVG 1.1//EN\" "
-                   "\"http://www.w3.org/Graphics/SVG/1.1/DTD/svg11.dtd\">\n";
-        svgFile << "<svg width=\"" << width << "\" height=\"" << height 
-                << "\" version=\"1.1\" xmlns=\"http://www.w3.org/2000/svg\">\n";
+        append("<?xml version=\"1.0\" standalone=\"no\"?>\n");
+        append("<!DOCTYPE svg PUBLIC \"-//W3C//DTD SVG 1.1//EN\" "
+               "\"http://www.w3.org/Graphics/SVG/1.1/DTD/svg11.dtd\">\n");
+        append("<svg width=\"");
+        append(width);
+        append("\" height=\"");
+        append(height);
+        append("\" version=\"1.1\" xmlns=\"http://www.w3.org/2000/svg\">\n");
     }
 
     // Destructor: Close SVG file and write footer
     ~svg() {
         if (svgFile.is_open()) {
-            svgFile << "</svg>\n";
+            append("</svg>\n");
+            flushBuffer();
             svgFile.close();
         }
     }
 
+    svg(const svg&) = delete;
+    svg& operator=(const svg&) = delete;
+
     // Public method to draw a line
     void draw_line(int x1, int y1, int x2, int y2, const color& clr) {
-                drawLineInternal(x1, y1, x2, y2, clr.tostr());
+        drawLineInternal(x1, y1, x2, y2, lineStyle(clr));
+    }
+
+    // Define a CSS class for draw_polyline and return its id. Rules may
+    // come anywhere in the document, so this can be called before or
+    // between paths.
+    int define_class(const std::string& name, const color& stroke, double width) {
+        std::ostringstream rule;
+        rule << "<style>." << name << "{fill:none;stroke:" << stroke.tostr()
+             << ";stroke-width:" << width << ";stroke-linejoin:round}</style>\n";
+        append(rule.str());
+        pathPrefixes.push_back("<path class=\"" + name + "\" d=\"M");
+        return static_cast<int>(pathPrefixes.size()) - 1;
+    }
+
+    // Define a CSS class for draw_polygon that fills with fill and has no
+    // stroke, and return its id
+    int define_fill_class(const std::string& name, const color& fill) {
+        append("<style>." + name + "{fill:" + fill.tostr() + ";fill-rule:evenodd;stroke:none}</style>\n");
+        pathPrefixes.push_back("<path class=\"" + name + "\" d=\"M");
+        return static_cast<int>(pathPrefixes.size()) - 1;
+    }
+
+    // One <path> through pts: an absolute move to the first point, then
+    // relative line steps, styled by a class from define_class. Repeated
+    // points are skipped; nothing is written for fewer than two distinct.
+    void draw_polyline(const std::vector<point>& pts, int css_class) {
+        if (!hasStep(pts, 0, pts.size())) return;
+        append(pathPrefixes.at(css_class));
+        subpath(pts, 0, pts.size());
+        append("\"/>\n");
+    }
+
+    // The rings pts[ring_start[i], ring_start[i + 1]) closed, as one
+    // <path> so that with a class from define_fill_class the inner rings
+    // cut holes. Rings without two distinct points are skipped.
+    void draw_polygon(const std::vector<point>& pts, const std::vector<uint32_t>& ring_start, int css_class) {
+        bool any = false;
+        for (size_t r = 0; r + 1 < ring_start.size(); ++r) {
+            if (!hasStep(pts, ring_start[r], ring_start[r + 1])) continue;
+            if (any) append('M');
+            else append(pathPrefixes.at(css_class));
+            subpath(pts, ring_start[r], ring_start[r + 1]);
+            append('z');
+            any = true;
+        }
+        if (any) append("\"/>\n");
+    }
+
+private:
+    static bool hasStep(const std::vector<point>& pts, size_t begin, size_t end) {
+        for (size_t i = begin + 1; i < end; ++i)
+            if (pts[i].x != pts[i - 1].x || pts[i].y != pts[i - 1].y) return true;
+        return false;
+    }
+
+    // Move to pts[begin], then relative steps through pts[begin, end)
+    void subpath(const std::vector<point>& pts, size_t begin, size_t end) {
+        append(pts[begin].x);
+        append(' ');
+        append(pts[begin].y);
+        append('l');
+        bool first = true;
+        for (size_t i = begin + 1; i < end; ++i) {
+            int dx = pts[i].x - pts[i - 1].x, dy = pts[i].y - pts[i - 1].y;
+            if (dx == 0 && dy == 0) continue;
+            pathNumber(dx, first);
+            pathNumber(dy, false);
+            first = false;
+        }
     }
 };
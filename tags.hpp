@@ -0,0 +1,114 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Interned tag strings. Every distinct key or value is stored once in a
+// block arena and referred to by a 32-bit id, so comparing tags is an
+// integer comparison and repeated strings ("highway", "yes") cost nothing.
+class TagDict {
+public:
+    static constexpr uint32_t NONE = 0xffffffff;
+
+    // Id of s, added to the dictionary if not seen before
+    uint32_t intern(std::string_view s) {
+        auto it = index.find(s);
+        if (it != index.end()) return it->second;
+        uint32_t id = static_cast<uint32_t>(strings.size());
+        std::string_view stored = store(s);
+        strings.push_back(stored);
+        index.emplace(stored, id);
+        return id;
+    }
+
+    // Id of s, or NONE if it was never interned
+    uint32_t find(std::string_view s) const {
+        auto it = index.find(s);
+        return it == index.end() ? NONE : it->second;
+    }
+
+    std::string_view str(uint32_t id) const {
+        return id < strings.size() ? strings[id] : std::string_view();
+    }
+
+    size_t size() const { return strings.size(); }
+
+private:
+    static constexpr size_t BLOCK_SIZE = 64 * 1024;
+
+    std::string_view store(std::string_view s) {
+        if (s.size() > block_left) {
+            size_t n = std::max(BLOCK_SIZE, s.size());
+            blocks.emplace_back(new char[n]);
+            block_ptr = blocks.back().get();
+            block_left = n;
+        }
+        if (!s.empty()) std::memcpy(block_ptr, s.data(), s.size());
+        std::string_view r(block_ptr, s.size());
+        block_ptr += s.size();
+        block_left -= s.size();
+        return r;
+    }
+
+    std::vector<std::unique_ptr<char[]>> blocks;
+    char* block_ptr{nullptr};
+    size_t block_left{0};
+    std::vector<std::string_view> strings;
+    std::unordered_map<std::string_view, uint32_t> index;
+};
+
+struct Tag {
+    uint32_t key;
+    uint32_t value;
+};
+
+// Slice of TagStore::tags belonging to one way or node
+struct TagRange {
+    uint32_t begin{0};
+    uint32_t count{0};
+};
+
+// All tags of a file in one flat array; elements keep a TagRange into it
+class TagStore {
+public:
+    TagDict dict;
+    std::vector<Tag> tags;
+
+    // Start collecting tags for a new element
+    uint32_t open() const { return static_cast<uint32_t>(tags.size()); }
+
+    void add(std::string_view k, std::string_view v) {
+        tags.push_back({dict.intern(k), dict.intern(v)});
+    }
+
+    TagRange close(uint32_t begin) const {
+        return {begin, static_cast<uint32_t>(tags.size()) - begin};
+    }
+
+    // Drop tags collected since open(), e.g. for a discarded element
+    void rollback(uint32_t begin) { tags.resize(begin); }
+
+    // Value id of key in r, or TagDict::NONE
+    uint32_t get(TagRange r, uint32_t key) const {
+        for (uint32_t i = r.begin; i < r.begin + r.count; ++i)
+            if (tags[i].key == key) return tags[i].value;
+        return TagDict::NONE;
+    }
+
+    bool has(TagRange r, uint32_t key) const {
+        return get(r, key) != TagDict::NONE;
+    }
+
+    bool has(TagRange r, uint32_t key, uint32_t value) const {
+        return value != TagDict::NONE && get(r, key) == value;
+    }
+
+    std::string_view value(TagRange r, std::string_view key) const {
+        uint32_t k = dict.find(key);
+        return k == TagDict::NONE ? std::string_view() : dict.str(get(r, k));
+    }
+};
@@ -0,0 +1,156 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "bmp.hpp"
+#include "lod.hpp"
+#include "osm.hpp"
+#include "png.hpp"
+#include "projection.hpp"
+#include "scene.hpp"
+#include "style.hpp"
+#include "threadpool.hpp"
+
+OsmData osm;
+
+int main(int argc, char* argv[]) {
+    if (argc < 3) {
+        std::cerr << "Usage: " << argv[0] << " <input.osm> <output_dir> [--zoom MIN-MAX] [--threads N] [--format png|bmp] [--aa] [--lod FILE] [--style FILE] [filter]\n"
+                  << "  writes output_dir/z/x/y.png web map tiles\n";
+        return 1;
+    }
+
+    const char* input_file = argv[1];
+    std::filesystem::path out_dir = argv[2];
+    int min_zoom = 14, max_zoom = 17;
+    unsigned threads = 0;
+    std::string filter_expr;
+    std::string format = "png";
+    bool antialias = false;
+    std::string lod_file;
+    std::string style_file;
+
+    for (int i = 3; i < argc; ++i) {
+        std::string opt = argv[i];
+        if (opt == "--zoom" && i + 1 < argc) {
+            std::string z = argv[++i];
+            if (std::sscanf(z.c_str(), "%d-%d", &min_zoom, &max_zoom) != 2) min_zoom = max_zoom = std::stoi(z);
+        } else if (opt == "--threads" && i + 1 < argc) {
+            threads = std::stoul(argv[++i]);
+        } else if (opt == "--aa") {
+            antialias = true;
+        } else if (opt == "--style" && i + 1 < argc) {
+            style_file = argv[++i];
+        } else if (opt == "--lod" && i + 1 < argc) {
+            lod_file = argv[++i];
+        } else if (opt == "--format" && i + 1 < argc) {
+            format = argv[++i];
+        } else if (opt.rfind("--", 0) != 0 && filter_expr.empty()) {
+            filter_expr = opt;
+        } else {
+            std::cerr << "Unknown option: " << opt << "\n";
+            return 1;
+        }
+    }
+    if (format != "png" && format != "bmp") {
+        std::cerr << "Unknown format: " << format << "\n";
+        return 1;
+    }
+    if (min_zoom < 0 || max_zoom > 24 || min_zoom > max_zoom) {
+        std::cerr << "Zoom range must be within 0-24\n";
+        return 1;
+    }
+
+    ThreadPool pool(threads);
+    StyleSheet sheet = style_file.empty() ? StyleSheet::defaults() : StyleSheet::load(style_file);
+    bool loaded = false;
+    auto load = [&] {
+        loaded = true;
+        TagFilter filter(filter_expr, osm.tags.dict);
+        load_osm(input_file, filter, filter.empty() ? LoadMode::AllNodes : LoadMode::ReferencedNodes, osm);
+        std::cout << "Loaded " << osm.nodes.size() << " nodes, " << osm.ways.size() << " ways\n";
+    };
+
+    // With --lod, zooms that have a level of detail read it instead of
+    // the full data, which is only parsed when some zoom still needs it
+    // or the LOD file has to be rebuilt
+    LodIndex lod;
+    bool have_lod = false;
+    LodSource source = lod_file.empty() ? LodSource{} : lod_source(input_file, filter_expr);
+    auto build_lod = [&] {
+        if (!loaded) load();
+        write_lod(lod_file, source, osm, LOD_ZOOMS, pool);
+        have_lod = read_lod_index(lod_file, source, lod);
+        std::cout << "Wrote " << lod_file << "\n";
+    };
+    if (!lod_file.empty()) {
+        have_lod = read_lod_index(lod_file, source, lod);
+        if (!have_lod) build_lod();
+    }
+    auto level_for = [&](int z) { return have_lod ? lod.level_for(z) : -1; };
+    if (!loaded && level_for(max_zoom) < 0) load();
+    double min_lat = have_lod ? lod.min_lat : osm.min_lat, max_lat = have_lod ? lod.max_lat : osm.max_lat;
+    double min_lon = have_lod ? lod.min_lon : osm.min_lon, max_lon = have_lod ? lod.max_lon : osm.max_lon;
+
+    std::atomic<size_t> written{0}, empty{0};
+    auto t0 = std::chrono::steady_clock::now();
+
+    // Zooms sharing a level are rendered together from one index
+    for (int z_begin = min_zoom; z_begin <= max_zoom;) {
+        int level = level_for(z_begin);
+        int z_end = z_begin + 1;
+        while (z_end <= max_zoom && level_for(z_end) == level) ++z_end;
+
+        OsmData level_data;
+        if (level >= 0) read_lod_level(lod_file, lod, level, level_data, build_lod);
+        OsmData& data = level >= 0 ? level_data : osm;
+        Scene scene(data, sheet, pool);
+        std::cout << "Zoom " << z_begin << "-" << z_end - 1 << " from "
+                  << (level >= 0 ? "level of detail " + std::to_string(lod.levels[level].zoom) : std::string("full data"))
+                  << ": " << scene.segments() << " segments\n";
+
+        // Every tile touching the data bounds or reached by a stroke from
+        // inside them, the group's zoom levels in one list
+        std::vector<TileId> tiles;
+        double pad = scene.padding() / TILE_SIZE;
+        for (int z = z_begin; z < z_end; ++z) {
+            int last = (1 << z) - 1;
+            int x0 = std::max(0, static_cast<int>(std::floor(lon_to_tile_x(min_lon, z) - pad)));
+            int x1 = std::min(last, static_cast<int>(lon_to_tile_x(max_lon, z) + pad));
+            int y0 = std::max(0, static_cast<int>(std::floor(lat_to_tile_y(max_lat, z) - pad)));
+            int y1 = std::min(last, static_cast<int>(lat_to_tile_y(min_lat, z) + pad));
+            for (int x = x0; x <= x1; ++x)
+                for (int y = y0; y <= y1; ++y) tiles.push_back({z, x, y});
+        }
+        z_begin = z_end;
+
+        pool.parallel_for(tiles.size(), [&](size_t t) {
+            const TileId& id = tiles[t];
+            BMP bmp(TILE_SIZE, TILE_SIZE);
+            if (!scene.render(Frame::tile(id), antialias, bmp)) {
+                ++empty;
+                return;
+            }
+
+            std::filesystem::path dir = out_dir / std::to_string(id.z) / std::to_string(id.x);
+            std::filesystem::create_directories(dir);
+            // Tiles are already spread over the pool, so each is compressed serially
+            std::string file = (dir / (std::to_string(id.y) + "." + format)).string();
+            if (format == "png") png::write(bmp, file);
+            else bmp.write(file);
+            ++written;
+        });
+    }
+
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    std::cout << "Zoom " << min_zoom << "-" << max_zoom << ": " << written << " tiles written, "
+              << empty << " empty skipped in " << secs << " s ("
+              << (written + empty) / std::max(secs, 1e-9) << " tiles/s)\n";
+    return 0;
+}
@@ -0,0 +1,236 @@
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "bmp.hpp"
+#include "cache.hpp"
+#include "lod.hpp"
+#include "osm.hpp"
+#include "png.hpp"
+#include "scene.hpp"
+#include "server.hpp"
+#include "style.hpp"
+#include "threadpool.hpp"
+
+// Render daemon: loads the map once and serves PNG tiles and viewports
+// over local HTTP, with encoded images kept in an LRU cache.
+//
+//   GET /z/x/y.png                            a 256 px web map tile
+//   GET /map.png?bbox=a,b,c,d&width=W&height=H  min_lon,min_lat,max_lon,max_lat fit into W x H
+//   GET /stats                                cache and request counters
+
+OsmData osm;
+
+constexpr int MAX_VIEW_SIZE = 4096;
+constexpr size_t MAX_REQUEST = 64 << 10; // request line and headers
+
+struct Response {
+    int status;
+    const char* type;
+    LruCache::Value body;
+    bool cached;
+};
+
+const char* reason(int status) {
+    switch (status) {
+    case 200: return "OK";
+    case 400: return "Bad Request";
+    case 404: return "Not Found";
+    default: return "Method Not Allowed";
+    }
+}
+
+// Length of the first request head in buffer, through the blank line
+// that ends it, or 0 until all of it has come. Blank lines before it
+// belong to it.
+size_t request_length(std::string_view buffer) {
+    size_t start = buffer.find_first_not_of("\r\n");
+    if (start == std::string_view::npos) return 0;
+    for (size_t nl = buffer.find('\n', start); nl != std::string_view::npos; nl = buffer.find('\n', nl + 1)) {
+        if (buffer.compare(nl + 1, 1, "\n") == 0) return nl + 2;
+        if (buffer.compare(nl + 1, 2, "\r\n") == 0) return nl + 3;
+    }
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " <input.osm> [--port N | --socket PATH] [--threads N] [--cache-mb N] [--aa] [--lod FILE] [--style FILE] [filter]\n"
+                  << "  serves /z/x/y.png tiles and /map.png?bbox=...&width=W&height=H over HTTP\n";
+        return 1;
+    }
+
+    const char* input_file = argv[1];
+    int port = 8080;
+    std::string socket_path;
+    unsigned threads = 0;
+    size_t cache_mb = 256;
+    bool antialias = false;
+    std::string lod_file;
+    std::string style_file;
+    std::string filter_expr;
+
+    for (int i = 2; i < argc; ++i) {
+        std::string opt = argv[i];
+        if (opt == "--port" && i + 1 < argc) {
+            port = std::stoi(argv[++i]);
+        } else if (opt == "--socket" && i + 1 < argc) {
+            socket_path = argv[++i];
+        } else if (opt == "--threads" && i + 1 < argc) {
+            threads = std::stoul(argv[++i]);
+        } else if (opt == "--cache-mb" && i + 1 < argc) {
+            cache_mb = std::stoul(argv[++i]);
+        } else if (opt == "--aa") {
+            antialias = true;
+        } else if (opt == "--lod" && i + 1 < argc) {
+            lod_file = argv[++i];
+        } else if (opt == "--style" && i + 1 < argc) {
+            style_file = argv[++i];
+        } else if (opt.rfind("--", 0) != 0 && filter_expr.empty()) {
+            filter_expr = opt;
+        } else {
+            std::cerr << "Unknown option: " << opt << "\n";
+            return 1;
+        }
+    }
+
+    ThreadPool pool(threads);
+    StyleSheet sheet = style_file.empty() ? StyleSheet::defaults() : StyleSheet::load(style_file);
+    auto t0 = std::chrono::steady_clock::now();
+    TagFilter filter(filter_expr, osm.tags.dict);
+    load_osm(input_file, filter, filter.empty() ? LoadMode::AllNodes : LoadMode::ReferencedNodes, osm);
+
+    // Levels of detail serve the zooms they cover; the full data the rest.
+    // Scenes refer to their data, so levels live in a deque that never moves them.
+    LodIndex lod;
+    std::deque<OsmData> levels;
+    std::vector<std::unique_ptr<Scene>> level_scenes;
+    if (!lod_file.empty()) {
+        LodSource source = lod_source(input_file, filter_expr);
+        auto build_lod = [&] {
+            write_lod(lod_file, source, osm, LOD_ZOOMS, pool);
+            read_lod_index(lod_file, source, lod);
+            std::cout << "Wrote " << lod_file << "\n";
+        };
+        if (!read_lod_index(lod_file, source, lod)) build_lod();
+        for (size_t i = 0; i < lod.levels.size(); ++i) {
+            read_lod_level(lod_file, lod, static_cast<int>(i), levels.emplace_back(), build_lod);
+            level_scenes.push_back(std::make_unique<Scene>(levels.back(), sheet, pool));
+        }
+    }
+    Scene full(osm, sheet, pool);
+    auto scene_for = [&](double zoom) -> const Scene& {
+        int level = lod_file.empty() ? -1 : lod.level_for(zoom);
+        return level >= 0 ? *level_scenes[level] : full;
+    };
+    std::cout << "Loaded " << osm.nodes.size() << " nodes, " << osm.ways.size() << " ways, "
+              << osm.multipolygons.size() << " multipolygons in "
+              << std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count() << " s\n";
+
+    LruCache cache(cache_mb << 20);
+    std::atomic<uint64_t> requests{0}, rendered{0};
+
+    // Tiles with nothing in view all share one blank image
+    BMP blank_bmp(TILE_SIZE, TILE_SIZE);
+    const LruCache::Value blank = std::make_shared<const std::string>(png::encode(blank_bmp));
+
+    auto render = [&](const Frame& f) {
+        BMP bmp(f.width, f.height);
+        if (!scene_for(f.zoom()).render(f, antialias, bmp) && f.width == TILE_SIZE && f.height == TILE_SIZE)
+            return blank;
+        ++rendered;
+        return std::make_shared<const std::string>(png::encode(bmp));
+    };
+
+    auto text = [](int status, const std::string& s) {
+        return Response{status, "text/plain", std::make_shared<const std::string>(s + "\n"), false};
+    };
+
+    // Answer for a request target: tiles and views go through the cache
+    auto respond = [&](const std::string& target) -> Response {
+        ++requests;
+        if (target == "/stats") {
+            LruCache::Stats s = cache.stats();
+            std::ostringstream out;
+            out << "requests " << requests << "\nrendered " << rendered << "\nhits " << s.hits << "\nmisses "
+                << s.misses << "\nevictions " << s.evictions << "\nentries " << s.entries << "\nbytes " << s.bytes
+                << "\nbudget " << s.budget;
+            return text(200, out.str());
+        }
+
+        Frame frame;
+        TileId id;
+        BBox box;
+        int width = 1024, height = 1024, end = 0;
+        if (std::sscanf(target.c_str(), "/%d/%d/%d.png%n", &id.z, &id.x, &id.y, &end) == 3 &&
+            end == static_cast<int>(target.size())) {
+            if (id.z < 0 || id.z > 24 || id.x < 0 || id.y < 0 || id.x >= (1 << id.z) || id.y >= (1 << id.z))
+                return text(404, "No such tile");
+            frame = Frame::tile(id);
+        } else if (target.rfind("/map.png?", 0) == 0) {
+            bool has_bbox = false;
+            std::istringstream query(target.substr(9));
+            for (std::string param; std::getline(query, param, '&');) {
+                if (param.rfind("bbox=", 0) == 0) {
+                    try {
+                        box = parse_bbox(param.substr(5));
+                        has_bbox = true;
+                    } catch (const std::exception& e) {
+                        return text(400, e.what());
+                    }
+                } else if (std::sscanf(param.c_str(), "width=%d", &width) != 1 &&
+                           std::sscanf(param.c_str(), "height=%d", &height) != 1) {
+                    return text(400, "Unknown parameter " + param);
+                }
+            }
+            if (!has_bbox) return text(400, "bbox is required");
+            if (width < 1 || height < 1 || width > MAX_VIEW_SIZE || height > MAX_VIEW_SIZE)
+                return text(400, "width and height must be 1-" + std::to_string(MAX_VIEW_SIZE));
+            frame = Frame::fit(box, width, height);
+        } else {
+            return text(404, "Not found");
+        }
+
+        if (LruCache::Value hit = cache.get(target)) return {200, "image/png", hit, true};
+        LruCache::Value png = render(frame);
+        cache.put(target, png);
+        return {200, "image/png", png, false};
+    };
+
+    // HTTP/1.1 with keep-alive; only GET
+    auto handle = [&](const std::string& head) -> server::Reply {
+        std::istringstream lines(head.substr(head.find_first_not_of("\r\n")));
+        std::string line;
+        std::getline(lines, line);
+        std::istringstream request(line);
+        std::string method, target, version;
+        request >> method >> target >> version;
+        bool keep_alive = version == "HTTP/1.1";
+        while (std::getline(lines, line)) {
+            for (char& c : line) c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+            if (line.rfind("connection:", 0) == 0) keep_alive = line.find("close") == std::string::npos;
+        }
+        Response r = method == "GET" ? respond(target) : text(405, "Only GET is supported");
+        std::string header = "HTTP/1.1 " + std::to_string(r.status) + " " + reason(r.status) +
+                             "\r\nContent-Type: " + r.type + "\r\nContent-Length: " + std::to_string(r.body->size()) +
+                             "\r\nX-Cache: " + (r.cached ? "hit" : "miss") +
+                             (keep_alive ? "\r\n\r\n" : "\r\nConnection: close\r\n\r\n");
+        return {header, r.body, !keep_alive};
+    };
+
+    int listen_fd = socket_path.empty() ? server::listen_tcp(port) : server::listen_unix(socket_path);
+    std::cout << "Serving on " << (socket_path.empty() ? "http://127.0.0.1:" + std::to_string(port) : socket_path)
+              << " with " << pool.size() << " workers, " << cache_mb << " MB cache" << std::endl;
+    server::serve(listen_fd, pool, request_length, handle, MAX_REQUEST);
+    if (!socket_path.empty()) unlink(socket_path.c_str());
+    std::cout << "Stopped after " << requests << " requests\n";
+    return 0;
+}